@@ -9,10 +9,12 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
 #include "report.h"
+#include "trace.h"
 #include "web.h"
 
 /* Some global values */
@@ -87,6 +89,8 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->calls = 0;
+    cmd->time = 0;
     cmd->next = next_cmd;
     *last_loc = cmd;
 }
@@ -167,18 +171,79 @@ static void record_error()
     }
 }
 
+/* Find command by name. Return NULL if there is no such command */
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *next_cmd = cmd_list;
+    while (next_cmd && strcmp(name, next_cmd->name) != 0)
+        next_cmd = next_cmd->next;
+    return next_cmd;
+}
+
+static void no_probe(int *size, long *blocks)
+{
+    *size = -1;
+    *blocks = 0;
+}
+
+static probe_func_t probe = no_probe;
+
+void set_probe(probe_func_t p)
+{
+    probe = p;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Execute command, keeping track of how often it runs and for how long */
+static bool call_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    double start;
+    bool logged = jsonlog_enabled();
+    int size_before = -1, size_after = -1;
+    long blocks_before = 0, blocks_after = 0;
+    int64_t start_ns = 0;
+
+    if (logged) {
+        probe(&size_before, &blocks_before);
+        jsonlog_begin();
+        start_ns = now_ns();
+    }
+    init_time(&start);
+    bool ok = cmd->operation(argc, argv);
+    /* quit frees the commands, this one included */
+    if (cmd_list) {
+        cmd->time += delta_time(&start);
+        cmd->calls++;
+    }
+    /* The log may have been closed by the command itself, which is still
+     * ended so that later errors get lines of their own
+     */
+    if (logged) {
+        int64_t ns = now_ns() - start_ns;
+        if (jsonlog_enabled())
+            probe(&size_after, &blocks_after);
+        jsonlog_command(argc, argv, ns, size_before, size_after,
+                        blocks_after - blocks_before, ok);
+    }
+    return ok;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    cmd_element_t *next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        ok = call_cmd(next_cmd, argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -231,6 +296,7 @@ static bool do_quit(int argc, char *argv[])
         c = c->next;
         free_block(ele, sizeof(cmd_element_t));
     }
+    cmd_list = NULL;
 
     param_element_t *p = param_list;
     while (p) {
@@ -238,6 +304,7 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    param_list = NULL;
 
     while (buf_stack)
         pop_file();
@@ -247,6 +314,7 @@ static bool do_quit(int argc, char *argv[])
     }
 
     quit_flag = true;
+    report_flush();
     return ok;
 }
 
@@ -371,6 +439,20 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static bool do_jsonlog(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "No log file given");
+        return false;
+    }
+
+    bool result = set_jsonlog(argv[1]);
+    if (!result)
+        report(1, "Couldn't open log file '%s'", argv[1]);
+
+    return result;
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -391,6 +473,91 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    bool timing = argc > 1 && !strcmp(argv[1], "-t");
+    int first = timing ? 2 : 1;
+    int reps = 0;
+    if (argc < first + 2) {
+        report(1, "%s needs a repetition count and a command", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[first], &reps) || reps < 0) {
+        report(1, "Invalid number of repetitions '%s'", argv[first]);
+        return false;
+    }
+
+    /* Look up command once and dispatch directly on every iteration */
+    cmd_element_t *cmd = find_cmd(argv[first + 1]);
+    if (!cmd) {
+        report(1, "Unknown command '%s'", argv[first + 1]);
+        return false;
+    }
+
+    int cmd_argc = argc - first - 1;
+    char **cmd_argv = calloc_or_fail(cmd_argc, sizeof(char *), "do_repeat");
+    double total = 0, min_time = 0, max_time = 0;
+    bool ok = true;
+    int r;
+    for (r = 0; ok && r < reps && !quit_flag; r++) {
+        /* Command functions may rearrange argv, so each call gets a copy */
+        memcpy(cmd_argv, argv + first + 1, cmd_argc * sizeof(char *));
+        /* Every iteration counts as a call of its own, in the metrics and
+         * in the json log
+         */
+        if (!timing) {
+            ok = call_cmd(cmd, cmd_argc, cmd_argv);
+            continue;
+        }
+
+        double start;
+        init_time(&start);
+        ok = call_cmd(cmd, cmd_argc, cmd_argv);
+        double delta = delta_time(&start);
+        total += delta;
+        if (r == 0 || delta < min_time)
+            min_time = delta;
+        if (delta > max_time)
+            max_time = delta;
+    }
+    free_array(cmd_argv, cmd_argc, sizeof(char *));
+
+    if (!ok)
+        report(1, "Iteration %d of '%s' failed", r, argv[first + 1]);
+    if (timing && r > 0)
+        report(1,
+               "Repetitions = %d, Total time = %.3f, "
+               "Min/Avg/Max = %.6f/%.6f/%.6f",
+               r, total, min_time, total / r, max_time);
+    return ok;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    /* Default output name replaces suffix '.cmd' with '.bin' */
+    char dst[PATH_MAX];
+    if (argc == 3) {
+        snprintf(dst, sizeof(dst), "%s", argv[2]);
+    } else {
+        size_t len = strlen(argv[1]);
+        if (len > 4 && !strcmp(argv[1] + len - 4, ".cmd"))
+            len -= 4;
+        snprintf(dst, sizeof(dst), "%.*s.bin", (int) len, argv[1]);
+    }
+
+    if (!trace_compile(argv[1], dst)) {
+        report(1, "Could not compile '%s' into '%s'", argv[1], dst);
+        return false;
+    }
+    report(2, "Compiled '%s' into '%s'", argv[1], dst);
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -414,6 +581,31 @@ static bool do_web(int argc, char *argv[])
     return true;
 }
 
+/* Report error count and per-command totals on /metrics */
+static void console_metrics(void)
+{
+    web_metrics_printf(
+        "# HELP qtest_errors_total Errors recorded by the console.\n"
+        "# TYPE qtest_errors_total counter\n"
+        "qtest_errors_total %d\n",
+        err_cnt);
+
+    web_metrics_printf(
+        "# HELP qtest_command_calls_total Commands executed, by name.\n"
+        "# TYPE qtest_command_calls_total counter\n");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next)
+        web_metrics_printf("qtest_command_calls_total{cmd=\"%s\"} %zu\n",
+                           cmd->name, cmd->calls);
+
+    web_metrics_printf(
+        "# HELP qtest_command_seconds_total Time spent in commands, by "
+        "name.\n"
+        "# TYPE qtest_command_seconds_total counter\n");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next)
+        web_metrics_printf("qtest_command_seconds_total{cmd=\"%s\"} %.6f\n",
+                           cmd->name, cmd->time);
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
@@ -422,13 +614,20 @@ void init_cmd()
     err_cnt = 0;
     quit_flag = false;
 
+    ADD_COMMAND(compile, "Compile command file into binary trace",
+                "file [out]");
     ADD_COMMAND(help, "Show summary", "");
     ADD_COMMAND(option,
                 "Display or set options. See 'Options' section for details",
                 "[name val]");
     ADD_COMMAND(quit, "Exit program", "");
+    ADD_COMMAND(repeat,
+                "Run command n times. With -t, report time per iteration",
+                "[-t] n cmd arg ...");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(jsonlog, "Log each command as a line of JSON to file",
+                "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
@@ -438,6 +637,8 @@ void init_cmd()
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
 
+    web_add_metrics(console_metrics);
+
     init_in();
     init_time(&last_time);
     first_time = last_time;
@@ -554,7 +755,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -582,15 +782,23 @@ static int cmd_select(int nfds,
             FD_SET(web_fd, readfds);
 
         if (infd == STDIN_FILENO && prompt_flag) {
+            report_flush();
             char *cmdline = linenoise(prompt);
-            if (cmdline)
-                interpret_cmd(cmdline);
+            if (cmdline) {
+                bool ok = interpret_cmd(cmdline);
+                /* Answer the client if the command came from the web */
+                web_cmd_done(ok);
+            }
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
             char *cmdline = readline();
             if (cmdline)
                 interpret_cmd(cmdline);
+            /* Nothing else writes out the output of a script, which would be
+             * lost if the program crashed or got killed later on
+             */
+            report_flush();
         }
     }
     return 0;
@@ -655,6 +863,7 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
+        report_flush();
         while (use_linenoise && (cmdline = linenoise(prompt))) {
             interpret_cmd(cmdline);
             line_history_add(cmdline);       /* Add to the history. */
@@ -663,6 +872,7 @@ bool run_console(char *infile_name)
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
             has_infile = false;
+            report_flush();
         }
         if (!use_linenoise) {
             while (!cmd_done())
@@ -675,3 +885,68 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+/* Echo a command replayed from binary trace as if it had been read */
+static void echo_record(int argc, char *argv[])
+{
+    report_noreturn(1, prompt);
+    for (int i = 0; i < argc; i++)
+        report_noreturn(1, i == 0 ? "%s" : " %s", argv[i]);
+    report_noreturn(1, "\n");
+}
+
+bool run_trace(char *trace_name)
+{
+    trace_t *trace = trace_load(trace_name);
+    if (!trace) {
+        report(1, "ERROR: Could not load binary trace '%s'", trace_name);
+        return false;
+    }
+
+    /* Commands are resolved once per distinct name, not once per line */
+    size_t n_strs = trace->n_strs + 1;
+    cmd_element_t **cmds =
+        calloc_or_fail(n_strs, sizeof(cmd_element_t *), "run_trace");
+    bool *resolved = calloc_or_fail(n_strs, sizeof(bool), "run_trace");
+
+    /* Command functions may rearrange argv, so each call gets a copy */
+    int max_argc = 1;
+    for (size_t i = 0; i < trace->n_records; i++) {
+        if (trace->records[i].argc > max_argc)
+            max_argc = trace->records[i].argc;
+    }
+    char **argv = calloc_or_fail(max_argc, sizeof(char *), "run_trace");
+
+    for (size_t i = 0; i < trace->n_records && !quit_flag; i++) {
+        const trace_record_t *rec = &trace->records[i];
+        uint32_t id = rec->ids[0];
+        if (!resolved[id]) {
+            cmds[id] = find_cmd(rec->argv[0]);
+            resolved[id] = true;
+        }
+
+        for (uint32_t r = 0; r < rec->repeat && !quit_flag; r++) {
+            memcpy(argv, rec->argv, rec->argc * sizeof(char *));
+            if (echo)
+                echo_record(rec->argc, argv);
+
+            if (!cmds[id]) {
+                report(1, "Unknown command '%s'", argv[0]);
+                record_error();
+            } else if (!call_cmd(cmds[id], rec->argc, argv)) {
+                record_error();
+            }
+            report_flush();
+
+            /* Nested source commands push text input */
+            while (!cmd_done())
+                cmd_select(0, NULL, NULL, NULL, NULL);
+        }
+    }
+
+    free_array(argv, max_argc, sizeof(char *));
+    free_array(resolved, n_strs, sizeof(bool));
+    free_array(cmds, n_strs, sizeof(cmd_element_t *));
+    trace_free(trace);
+    return err_cnt == 0;
+}
@@ -24,6 +24,8 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    size_t calls; /* Number of times executed */
+    double time;  /* Total time spent in operation, in seconds */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -53,6 +55,12 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Report the size of the current queue, or -1 if there is none, and the
+ * number of blocks allocated, for the structured log
+ */
+typedef void (*probe_func_t)(int *size, long *blocks);
+void set_probe(probe_func_t probe);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
@@ -68,6 +76,9 @@ bool finish_cmd();
  */
 bool run_console(char *infile_name);
 
+/* Replay commands from binary trace produced by the compile command */
+bool run_trace(char *trace_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
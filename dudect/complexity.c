@@ -0,0 +1,347 @@
+/* Empirical estimate of the time complexity of queue operations.
+ *
+ * Each operation is timed on queues of a geometric series of sizes, and every
+ * model of COMPLEXITY_MODELS is fitted to the measurements:
+ *
+ *  - a single measurement is noisy, so the median of REPEATS runs is taken at
+ *    every size. The overhead of reading the cycle counter is subtracted.
+ *
+ *  - a model f is fitted as cycles = b * f(n) by least squares on the relative
+ *    error, so that the large sizes do not outweigh the small ones. Leaving
+ *    out the intercept keeps the models apart: a constant term fits any of
+ *    them once b is small enough.
+ *
+ *  - the model with the smallest error wins, unless a simpler one comes close
+ *    enough. How much larger the error of the runner-up is gives the
+ *    confidence of the verdict.
+ *
+ *  - q_sort is timed on random, ascending and descending input, keeping the
+ *    slowest, so that an implementation degrading on presorted input is
+ *    caught.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../random.h"
+#include "complexity.h"
+#include "constant.h"
+#include "cpucycles.h"
+#include "queue.h"
+
+/* Runs of an operation at each size */
+#define REPEATS 31
+
+/* Operations timed together in one run of a constant time operation, which
+ * would otherwise be too short for the cycle counter
+ */
+#define BATCH 16
+
+/* Sizes are no longer increased once a run takes this many cycles, so that
+ * a quadratic implementation still finishes in reasonable time
+ */
+#define MAX_CYCLES 500000000
+
+/* A model wins over a simpler one only if its error is this many times
+ * smaller, since the more complex model can also follow noise
+ */
+#define PARSIMONY 1.5
+
+/* Fewest sizes a model is fitted to */
+#define MIN_SIZES 4
+
+/* Memory written before every run to evict the queue from the caches */
+#define EVICT_SIZE (8 << 20)
+
+/* Input orders q_sort is timed on */
+enum { ORDER_RANDOM, ORDER_ASCEND, ORDER_DESCEND, N_ORDERS };
+
+static const char *model_names[] = {
+#define _(x, s) #x,
+    COMPLEXITY_MODELS
+#undef _
+};
+
+static const char *model_descs[] = {
+#define _(x, s) s,
+    COMPLEXITY_MODELS
+#undef _
+};
+
+static const int expected_models[] = {
+#define _(x, c) MODEL(c),
+    DUT_FUNCS
+#undef _
+};
+
+int complexity_model(const char *name)
+{
+    for (int i = 0; i < N_MODELS; i++) {
+        if (!strcmp(name, model_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+const char *complexity_model_desc(int model)
+{
+    return model_descs[model];
+}
+
+int complexity_expected(int mode)
+{
+    return expected_models[mode];
+}
+
+static double model_cost(int model, double n)
+{
+    switch (model) {
+    case MODEL(const):
+        return 1;
+    case MODEL(log):
+        return log2(n);
+    case MODEL(linear):
+        return n;
+    case MODEL(linearithmic):
+        return n * log2(n);
+    default:
+        return n * n;
+    }
+}
+
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int64_t median(int64_t *samples, size_t n)
+{
+    qsort(samples, n, sizeof(int64_t), cmp);
+    return samples[n / 2];
+}
+
+static char *random_string(char *buf)
+{
+    randombytes((uint8_t *) buf, 7);
+    for (int i = 0; i < 7; i++)
+        buf[i] = 'a' + (uint8_t) buf[i] % 26;
+    buf[7] = 0;
+    return buf;
+}
+
+/* Make a new queue of n random strings, arranged in order */
+static struct list_head *build(int n, int order)
+{
+    char s[8];
+    struct list_head *l = q_new();
+    if (!l)
+        return NULL;
+    for (int i = 0; i < n; i++) {
+        if (!q_insert_head(l, random_string(s))) {
+            q_free(l);
+            return NULL;
+        }
+    }
+    if (order != ORDER_RANDOM)
+        q_sort(l, order == ORDER_DESCEND);
+    return l;
+}
+
+/* Time a run of operation mode on queue l of n elements, leaving the queue
+ * with n elements again. Return -1 if the implementation misbehaved.
+ */
+static int64_t time_op(int mode, struct list_head *l, int n)
+{
+    char s[BATCH][8];
+    int64_t before = 0, after = 0;
+    element_t *e[BATCH] = {NULL};
+    bool ok = true;
+
+    for (int i = 0; i < BATCH; i++)
+        random_string(s[i]);
+    switch (mode) {
+    case DUT(insert_head):
+        before = cpucycles_start();
+        for (int i = 0; i < BATCH; i++)
+            ok &= q_insert_head(l, s[i]);
+        after = cpucycles_stop();
+        for (int i = 0; i < BATCH; i++)
+            e[i] = q_remove_head(l, NULL, 0);
+        break;
+    case DUT(insert_tail):
+        before = cpucycles_start();
+        for (int i = 0; i < BATCH; i++)
+            ok &= q_insert_tail(l, s[i]);
+        after = cpucycles_stop();
+        for (int i = 0; i < BATCH; i++)
+            e[i] = q_remove_tail(l, NULL, 0);
+        break;
+    case DUT(remove_head):
+        before = cpucycles_start();
+        for (int i = 0; i < BATCH; i++)
+            e[i] = q_remove_head(l, NULL, 0);
+        after = cpucycles_stop();
+        for (int i = 0; i < BATCH; i++)
+            ok &= q_insert_head(l, s[i]);
+        break;
+    case DUT(remove_tail):
+        before = cpucycles_start();
+        for (int i = 0; i < BATCH; i++)
+            e[i] = q_remove_tail(l, NULL, 0);
+        after = cpucycles_stop();
+        for (int i = 0; i < BATCH; i++)
+            ok &= q_insert_tail(l, s[i]);
+        break;
+    case DUT(size):
+        before = cpucycles_start();
+        ok = q_size(l) == n;
+        after = cpucycles_stop();
+        break;
+    case DUT(reverse):
+        before = cpucycles_start();
+        q_reverse(l);
+        after = cpucycles_stop();
+        break;
+    case DUT(delete_mid):
+        before = cpucycles_start();
+        ok = q_delete_mid(l);
+        after = cpucycles_stop();
+        ok = ok && q_insert_head(l, s[0]);
+        break;
+    case DUT(sort):
+        before = cpucycles_start();
+        q_sort(l, false);
+        after = cpucycles_stop();
+        break;
+    }
+    for (int i = 0; i < BATCH; i++) {
+        if (e[i])
+            q_release_element(e[i]);
+    }
+
+    return ok && q_size(l) == n ? after - before : -1;
+}
+
+/* Start from the same cache state at every size. Otherwise small queues run
+ * out of the L1 cache and large ones do not, which no model accounts for.
+ */
+static void evict(void)
+{
+    static volatile uint8_t buf[EVICT_SIZE];
+    for (size_t i = 0; i < EVICT_SIZE; i += 64)
+        buf[i]++;
+}
+
+/* Median cycles of operation mode on a queue of n elements in order */
+static int64_t measure_size(int mode, int n, int order)
+{
+    int64_t samples[REPEATS];
+    struct list_head *l = NULL;
+
+    for (int i = 0; i < REPEATS; i++) {
+        /* Sorting leaves the queue sorted, so every run sorts a new one */
+        if (!l || mode == DUT(sort)) {
+            q_free(l);
+            l = build(n, order);
+            if (!l)
+                return -1;
+        }
+        evict();
+        samples[i] = time_op(mode, l, n);
+        if (samples[i] < 0) {
+            q_free(l);
+            return -1;
+        }
+    }
+    q_free(l);
+    return median(samples, REPEATS);
+}
+
+/* Median cycles taken by reading the cycle counter itself */
+static int64_t overhead(void)
+{
+    int64_t samples[REPEATS];
+    for (int i = 0; i < REPEATS; i++) {
+        int64_t before = cpucycles_start();
+        samples[i] = cpucycles_stop() - before;
+    }
+    return median(samples, REPEATS);
+}
+
+/* Fit cycles = b * f(n) minimizing the relative error, return its RMS */
+static double fit(const complexity_t *r, int model)
+{
+    double x[N_SIZES], sx = 0, sxx = 0;
+    for (int i = 0; i < r->n_sizes; i++) {
+        x[i] = model_cost(model, r->sizes[i]) / r->cycles[i];
+        sx += x[i];
+        sxx += x[i] * x[i];
+    }
+
+    double b = sx / sxx, err = 0;
+    for (int i = 0; i < r->n_sizes; i++)
+        err += (1 - b * x[i]) * (1 - b * x[i]);
+    return sqrt(err / r->n_sizes);
+}
+
+/* Least squares slope of log(cycles) against log(n) */
+static double loglog_slope(const complexity_t *r)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int k = r->n_sizes;
+    for (int i = 0; i < k; i++) {
+        double x = log(r->sizes[i]), y = log(r->cycles[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    return (k * sxy - sx * sy) / (k * sxx - sx * sx);
+}
+
+bool complexity_estimate(int mode, complexity_t *r)
+{
+    int orders = mode == DUT(sort) ? N_ORDERS : 1;
+    int ops = complexity_expected(mode) == MODEL(const) ? BATCH : 1;
+    int64_t base = overhead();
+
+    r->n_sizes = 0;
+    for (int i = 0; i < N_SIZES; i++) {
+        int n = 1 << (MIN_LOG_SIZE + i);
+        int64_t worst = 0;
+        for (int order = 0; order < orders; order++) {
+            int64_t cycles = measure_size(mode, n, order);
+            if (cycles < 0)
+                return false;
+            if (cycles > worst)
+                worst = cycles;
+        }
+        r->sizes[i] = n;
+        /* Keep the cycles positive for the relative error and the log */
+        r->cycles[i] = worst > base ? (double) (worst - base) / ops : 1;
+        r->n_sizes++;
+        if (worst > MAX_CYCLES && r->n_sizes >= MIN_SIZES)
+            break;
+    }
+
+    r->best = 0;
+    for (int m = 0; m < N_MODELS; m++) {
+        r->error[m] = fit(r, m);
+        if (r->error[m] * PARSIMONY < r->error[r->best])
+            r->best = m;
+    }
+
+    double runner_up = INFINITY;
+    for (int m = 0; m < N_MODELS; m++) {
+        if (m != r->best && r->error[m] < runner_up)
+            runner_up = r->error[m];
+    }
+    r->confidence = 1 - r->error[r->best] / runner_up;
+    if (r->confidence < 0)
+        r->confidence = 0;
+    r->slope = loglog_slope(r);
+    return true;
+}
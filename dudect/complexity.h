@@ -0,0 +1,57 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Time complexity models fitted to the measurements. The names of the
+ * models double as the complexity classes in DUT_FUNCS.
+ */
+#define COMPLEXITY_MODELS      \
+    _(const, "1")              \
+    _(log, "log n")            \
+    _(linear, "n")             \
+    _(linearithmic, "n log n") \
+    _(quadratic, "n^2")
+
+#define MODEL(x) MODEL_##x
+
+enum {
+#define _(x, s) MODEL(x),
+    COMPLEXITY_MODELS
+#undef _
+    N_MODELS
+};
+
+/* Queue sizes 2^MIN_LOG_SIZE .. 2^MAX_LOG_SIZE are measured, unless the
+ * operation becomes too slow on the way
+ */
+#define MIN_LOG_SIZE 7
+#define MAX_LOG_SIZE 13
+#define N_SIZES (MAX_LOG_SIZE - MIN_LOG_SIZE + 1)
+
+typedef struct {
+    int n_sizes; /* Number of sizes measured */
+    double sizes[N_SIZES];
+    double cycles[N_SIZES]; /* Median cycles per operation at each size */
+    double error[N_MODELS]; /* Relative RMS error of each model */
+    int best;               /* Model fitting the measurements best */
+    double confidence;      /* 0 (ambiguous) .. 1 (clear cut) */
+    double slope;           /* Slope of cycles against size on log-log scale */
+} complexity_t;
+
+/* Find model by name, e.g. "linear". Return -1 if there is none */
+int complexity_model(const char *name);
+
+/* Describe model as a function of n, e.g. "n log n" */
+const char *complexity_model_desc(int model);
+
+/* Model operation mode of DUT_FUNCS is expected to follow */
+int complexity_expected(int mode);
+
+/* Time operation mode of DUT_FUNCS at a geometric series of queue sizes and
+ * fit every model to the measurements. Return false if the implementation
+ * misbehaved.
+ */
+bool complexity_estimate(int mode, complexity_t *result);
+
+#endif
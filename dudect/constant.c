@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -8,17 +9,21 @@
 #include "random.h"
 
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Every measuring thread works on a queue of its own.
  */
-static struct list_head *l = NULL;
+static _Thread_local struct list_head *l = NULL;
 
-#define dut_new() ((void) (l = q_new()))
+/* Building a queue of thousands of elements for every sample would take far
+ * longer than the operation being timed. Instead, every measuring thread
+ * builds a pool of elements once, linked in the order of nodes[]. A sample
+ * borrows a run of consecutive elements as queue l, and gives it back once
+ * the operation has been timed.
+ */
+#define POOL_SIZE (10000 + N_REPEATS)
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
+static _Thread_local struct list_head *pool = NULL;
+static _Thread_local struct list_head **nodes = NULL;
 
 #define dut_insert_head(s, n)    \
     do {                         \
@@ -34,15 +39,142 @@ static struct list_head *l = NULL;
             q_insert_tail(l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
+/* Cost of running an operation of each complexity class on n elements */
+static double cost_const(int n)
+{
+    (void) n;
+    return 1;
+}
+
+static double cost_linear(int n)
+{
+    return n;
+}
+
+static double cost_linearithmic(int n)
+{
+    return n * log2(n);
+}
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static double (*const dut_cost[])(int) = {
+#define _(x, c) cost_##c,
+    DUT_FUNCS
+#undef _
+};
+
+static _Thread_local char random_string[N_MEASURES][8];
+static _Thread_local int random_string_iter = 0;
 
 /* Implement the necessary queue interface to simulation */
-void init_dut(void)
+bool init_dut(void)
 {
-    l = NULL;
+    l = q_new();
+    pool = q_new();
+    nodes = malloc(POOL_SIZE * sizeof(struct list_head *));
+    if (!l || !pool || !nodes) {
+        free_dut();
+        return false;
+    }
+
+    /* Inserting at the head leaves the newest blocks first in the pool, so
+     * freeing it does not need to search the harness' list of blocks.
+     */
+    char s[8] = {0};
+    for (int i = 0; i < POOL_SIZE; i++) {
+        randombytes((uint8_t *) s, 7);
+        if (!q_insert_head(pool, s)) {
+            free_dut();
+            return false;
+        }
+    }
+
+    struct list_head *node = pool->next;
+    for (int i = 0; i < POOL_SIZE; i++, node = node->next)
+        nodes[i] = node;
+    return true;
+}
+
+void free_dut(void)
+{
+    q_free(pool);
+    q_free(l);
+    free(nodes);
+    pool = l = NULL;
+    nodes = NULL;
+}
+
+/* Lend elements nodes[off] .. nodes[off + n - 1] to queue l */
+static void dut_attach(int off, int n)
+{
+    INIT_LIST_HEAD(l);
+    if (!n)
+        return;
+    struct list_head *first = nodes[off], *last = nodes[off + n - 1];
+    l->next = first;
+    first->prev = l;
+    l->prev = last;
+    last->next = l;
+}
+
+/* A queue built right before the measurement would sit in the cache, while
+ * a run of elements from deep in the pool may not. Touch elements nodes[from]
+ * .. nodes[to - 1] and their strings, so that where the run comes from does
+ * not show in the timing.
+ */
+static _Thread_local volatile char warm_sink;
+
+static void dut_warm(int from, int to)
+{
+    char sum = 0;
+    for (int i = from; i < to; i++)
+        sum ^= *list_entry(nodes[i], element_t, list)->value;
+    warm_sink = sum;
+}
+
+/* Give the elements lent by dut_attach back to the pool. Unless the operation
+ * reordered them, only the ends of the run need to be linked again.
+ */
+static void dut_detach(int off, int n, bool reordered)
+{
+    struct list_head *prev = off ? nodes[off - 1] : pool;
+    struct list_head *next = off + n < POOL_SIZE ? nodes[off + n] : pool;
+
+    if (reordered) {
+        for (int i = off; i < off + n; i++) {
+            prev->next = nodes[i];
+            nodes[i]->prev = prev;
+            prev = nodes[i];
+        }
+    } else if (n) {
+        nodes[off]->prev = prev;
+        prev = nodes[off + n - 1];
+    }
+    prev->next = next;
+    next->prev = prev;
+    INIT_LIST_HEAD(l);
+}
+
+/* Free the N_REPEATS elements the operation inserted at the head (or tail)
+ * of queue l, which should come right before stop. Return false if they
+ * cannot be found there.
+ */
+static bool dut_remove_inserted(struct list_head *stop, bool tail)
+{
+    struct list_head *cur = l;
+    for (int j = 0; j < N_REPEATS; j++) {
+        cur = tail ? cur->prev : cur->next;
+        if (cur == l || cur == stop)
+            return false;
+    }
+    if ((tail ? cur->prev : cur->next) != stop)
+        return false;
+
+    for (int j = 0; j < N_REPEATS; j++) {
+        struct list_head *node = tail ? l->prev : l->next;
+        list_del(node);
+        q_release_element(list_entry(node, element_t, list));
+    }
+    return true;
 }
 
 static char *get_random_string(void)
@@ -51,6 +183,26 @@ static char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+/* q_delete_mid freed one of the n elements lent at off, put a new one in its
+ * place. Return false if none can be allocated.
+ */
+static bool dut_replace_deleted(int off, int n)
+{
+    struct list_head *cur = l->next;
+    int k = 0;
+    while (k < n - 1 && cur == nodes[off + k]) {
+        cur = cur->next;
+        k++;
+    }
+
+    if (!q_insert_head(l, get_random_string()))
+        return false;
+    struct list_head *node = l->next;
+    list_del(node);
+    nodes[off + k] = node;
+    return true;
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
@@ -72,90 +224,144 @@ bool measure(int64_t *before_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+    assert(mode >= 0 &&
+           mode < (int) (sizeof(dut_cost) / sizeof(dut_cost[0])));
 
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
+            int n = *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000;
+            dut_attach(0, n);
+            dut_warm(0, n < 1 ? n : 1);
+            before_ticks[i] = cpucycles_start();
+            dut_insert_head(s, N_REPEATS);
+            after_ticks[i] = cpucycles_stop();
+            bool ok = dut_remove_inserted((n ? nodes[0] : l), false);
+            dut_detach(0, n, !ok);
+            if (!ok)
                 return false;
         }
         break;
     case DUT(insert_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
+            int n = *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000;
+            dut_attach(0, n);
+            dut_warm(n < 1 ? 0 : n - 1, n);
+            before_ticks[i] = cpucycles_start();
+            dut_insert_tail(s, N_REPEATS);
+            after_ticks[i] = cpucycles_stop();
+            bool ok = dut_remove_inserted((n ? nodes[n - 1] : l), true);
+            dut_detach(0, n, !ok);
+            if (!ok)
                 return false;
         }
         break;
     case DUT(remove_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
+            int n = *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 +
+                    N_REPEATS;
+            dut_attach(0, n);
+            dut_warm(0, N_REPEATS + 1 < n ? N_REPEATS + 1 : n);
+            element_t *e[N_REPEATS];
+            before_ticks[i] = cpucycles_start();
+            for (int j = 0; j < N_REPEATS; j++)
+                e[j] = q_remove_head(l, NULL, 0);
+            after_ticks[i] = cpucycles_stop();
+            /* Put the elements back in place, unless they are not ours.
+             * Giving back a run that is not intact relinks all of it.
+             */
+            bool ok = true;
+            for (int j = 0; j < N_REPEATS; j++)
+                ok = ok && e[j] && &e[j]->list == nodes[j];
+            for (int j = N_REPEATS - 1; ok && j >= 0; j--)
+                list_add(nodes[j], l);
+            dut_detach(0, n, !ok);
+            if (!ok)
                 return false;
         }
         break;
     case DUT(remove_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
+            int n = *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 +
+                    N_REPEATS;
+            dut_attach(0, n);
+            dut_warm(n > N_REPEATS ? n - N_REPEATS - 1 : 0, n);
+            element_t *e[N_REPEATS];
+            before_ticks[i] = cpucycles_start();
+            for (int j = 0; j < N_REPEATS; j++)
+                e[j] = q_remove_tail(l, NULL, 0);
+            after_ticks[i] = cpucycles_stop();
+            bool ok = true;
+            for (int j = 0; j < N_REPEATS; j++)
+                ok = ok && e[j] && &e[j]->list == nodes[n - 1 - j];
+            for (int j = N_REPEATS - 1; ok && j >= 0; j--)
+                list_add_tail(nodes[n - 1 - j], l);
+            dut_detach(0, n, !ok);
+            if (!ok)
                 return false;
         }
         break;
     default:
+        /* Scaling operations run on a queue of SCALE_FIXED elements in
+         * class 0 and of a random size in class 1. The execution time is
+         * divided by the cost the operation is expected to have at that size,
+         * so an implementation of the right complexity looks constant time to
+         * the t-test, while one that grows faster does not.
+         *
+         * The run of elements lent starts at a random offset into the pool,
+         * so that q_sort does not see the same input over and over.
+         */
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            uint16_t r = *(uint16_t *) (input_data + i * CHUNK_SIZE);
+            int n = r ? SCALE_MIN * pow((double) SCALE_MAX / SCALE_MIN,
+                                        r / 65536.0)
+                      : SCALE_FIXED;
+            uint32_t off;
+            randombytes((uint8_t *) &off, sizeof(off));
+            off %= POOL_SIZE - n + 1;
+            dut_attach(off, n);
+            dut_warm(off, off + n);
+            int expect = n, result = n;
+            before_ticks[i] = cpucycles_start();
+            switch (mode) {
+            case DUT(size):
+                result = q_size(l);
+                break;
+            case DUT(reverse):
+                q_reverse(l);
+                break;
+            case DUT(delete_mid):
+                if (q_delete_mid(l))
+                    expect--;
+                else
+                    result = -1;
+                break;
+            case DUT(sort):
+                q_sort(l, false);
+                break;
+            }
+            after_ticks[i] = cpucycles_stop();
+            int after_size = q_size(l);
+            bool ok = result == n && after_size == expect;
+            if (ok && mode == DUT(delete_mid))
+                ok = dut_replace_deleted(off, n);
+            dut_detach(off, n, !ok || mode != DUT(size));
+            if (!ok)
+                return false;
+
+            double ticks = after_ticks[i] - before_ticks[i];
+            ticks *= dut_cost[mode](SCALE_FIXED) / dut_cost[mode](n);
+            after_ticks[i] = before_ticks[i] + (int64_t) ticks;
+        }
+    }
+
+    /* Constant time operations were repeated, keep the time of a single one */
+    if (dut_cost[mode] == cost_const) {
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            int64_t ticks = after_ticks[i] - before_ticks[i];
+            after_ticks[i] = before_ticks[i] + ticks / N_REPEATS;
         }
     }
     return true;
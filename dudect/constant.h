@@ -12,21 +12,44 @@
 
 #define DROP_SIZE 20
 
-#define DUT_FUNCS  \
-    _(insert_head) \
-    _(insert_tail) \
-    _(remove_head) \
-    _(remove_tail)
+/* Constant time operations are repeated this many times per measurement,
+ * since a single one takes too few cycles to time reliably
+ */
+#define N_REPEATS 8
+
+/* Size of the queue every sample of a scaling operation runs on in class 0.
+ * Class 1 draws the size from [SCALE_MIN, SCALE_MAX] instead, uniformly on a
+ * log scale. SCALE_FIXED is their geometric mean, so that effects growing
+ * with log n, such as the cache misses of larger queues, even out between the
+ * classes. Being no power of two, it does not favor a merge sort either.
+ */
+#define SCALE_FIXED 1000
+#define SCALE_MIN 500
+#define SCALE_MAX 2000
+
+/* Operations under test, along with the time complexity they should have:
+ * const, linear or linearithmic.
+ */
+#define DUT_FUNCS         \
+    _(insert_head, const) \
+    _(insert_tail, const) \
+    _(remove_head, const) \
+    _(remove_tail, const) \
+    _(size, linear)       \
+    _(reverse, linear)    \
+    _(delete_mid, linear) \
+    _(sort, linearithmic)
 
 #define DUT(x) DUT_##x
 
 enum {
-#define _(x) DUT(x),
+#define _(x, c) DUT(x),
     DUT_FUNCS
 #undef _
 };
 
-void init_dut();
+bool init_dut(void);
+void free_dut(void);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
@@ -15,6 +15,9 @@
  *    by the OS.) Setting a threshold value for this is not obvious; we just
  *    keep the x% percent fastest timings, and repeat for several values of x.
  *
+ *    The thresholds are percentiles of a calibration batch that is measured
+ *    and discarded before the actual run.
+ *
  *  - the previous observation is highly heuristic. We also keep the uncropped
  *    measurement time and do a t-test on that.
  *
@@ -24,10 +27,27 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - statistics are evaluated after every round of batches, and a try stops
+ *    early once a leak is clear. Constant time takes the full budget.
+ *
+ *  - batches of measurements are independent, so they can be spread over
+ *    several worker threads, each pinned to its own CPU and keeping its own
+ *    statistics. Those are merged before the t-test is evaluated. Threads
+ *    last for a whole try, measuring one round after another.
  */
 
+/* pthread_setaffinity_np and the CPU_* macros are GNU extensions */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +56,10 @@
 #include "../console.h"
 #include "../random.h"
 
+/* Uses the C library allocator, like the rest of the fixture */
+#define INTERNAL 1
+#include "../harness.h"
+
 #include "constant.h"
 #include "fixture.h"
 #include "ttest.h"
@@ -43,14 +67,70 @@
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
+/* Number of cropping thresholds */
+#define N_PERCENTILES 100
+
+/* Uncropped test, one test per threshold, and the second-order test */
+#define N_TESTS (1 + N_PERCENTILES + 1)
+#define SECOND_ORDER_TEST (N_TESTS - 1)
+
+/* Samples the uncropped test collects before the second-order test starts,
+ * so that the mean used for centering has settled
+ */
+#define SECOND_ORDER_WARMUP 1000
+
+/* Tests with fewer samples are too noisy to take part in the verdict */
+#define ENOUGH_PER_TEST (ENOUGH_MEASURE / 10)
+
+/* Batches measured to derive the cropping thresholds */
+#define CALIBRATION_BATCHES 10
+
+/* Batches measured between two looks at the statistics */
+#define ROUND_BATCHES 10
+
+/* Uncertainty of a t value, in standard errors, for early decisions */
+#define T_MARGIN 3
+
 static t_context_t *t;
 
+/* Cropping thresholds in ascending order, fixed for the whole run */
+static int64_t percentiles[N_PERCENTILES];
+
+/* Number of threads taking measurements */
+int dudect_workers = 1;
+
+/* Upper bound for the workers option */
+#define MAX_WORKERS 64
+
+/* Rounds are handed out to worker threads that last for a whole try, so
+ * that each builds its pool of elements once rather than every round.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int round;   /* number of the round handed out last */
+    int pending; /* threads yet to finish that round */
+    bool stop;   /* no rounds are left in the try */
+} rounds_t;
+
+typedef struct {
+    pthread_t thread;
+    rounds_t *rounds;
+    int mode;
+    int batches; /* number of calls to doit in the current round */
+    int cpu;     /* CPU to run on, or -1 to leave placement to the OS */
+    t_context_t t[N_TESTS];
+    bool ok; /* implementation behaved correctly */
+} worker_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
     t_threshold_moderate = 10, /* Test failed */
 };
 
+typedef enum { UNDECIDED, LEAKAGE, NO_LEAKAGE } verdict_t;
+
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
@@ -64,7 +144,28 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Set the cropping thresholds from n sorted samples. They are spaced so that
+ * most of them lie in the fast part of the distribution: the i-th keeps the
+ * fastest 1 - 0.5^(10 * (i + 1) / N_PERCENTILES) of the measurements.
+ */
+static void prepare_percentiles(const int64_t *sorted, size_t n)
+{
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES);
+        size_t pos = which * n;
+        percentiles[i] = sorted[pos < n ? pos : n - 1];
+    }
+}
+
+static void update_statistics(t_context_t *t,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
     for (size_t i = 0; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
@@ -73,22 +174,78 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several thresholds.
+         * Thresholds ascend, so the sample belongs to every test from the
+         * first one whose threshold exceeds it.
+         */
+        int lo = 0, hi = N_PERCENTILES;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (difference < percentiles[mid])
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        for (int crop = lo; crop < N_PERCENTILES; crop++)
+            t_push(&t[crop + 1], difference, classes[i]);
+
+        /* do a second-order test (only if we have more than a few
+         * measurements). Centered product pre-processing.
+         */
+        if (t[0].n[0] > SECOND_ORDER_WARMUP) {
+            double centered = difference - t[0].mean[classes[i]];
+            t_push(&t[SECOND_ORDER_TEST], centered * centered, classes[i]);
+        }
     }
 }
 
-static bool report(void)
+/* Test with the largest |t| among those with enough samples */
+static t_context_t *max_test(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    int ret = 0;
+    double max = 0;
+    for (int i = 0; i < N_TESTS; i++) {
+        if (t[i].n[0] + t[i].n[1] < ENOUGH_PER_TEST)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
+    }
+    return &t[ret];
+}
+
+/* Decision before the whole budget is spent. A t value that stays above the
+ * threshold even when lowered by T_MARGIN for its own noise is unlikely to
+ * come back down, so a leak is reported right away. Constant time is only
+ * concluded from the whole budget: a small leak may rise above the noise
+ * late, and stopping early would lose the power to see it.
+ */
+static verdict_t early_verdict(double max_t)
+{
+    if (max_t - T_MARGIN > t_threshold_moderate)
+        return LEAKAGE;
+    return UNDECIDED;
+}
+
+static verdict_t report(void)
+{
+    t_context_t *t_max = max_test();
+    double max_t = fabs(t_compute(t_max));
+    double number_traces_max_t = t_max->n[0] + t_max->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
+    double number_traces = t[0].n[0] + t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    /* Too early to tell even a clear leak */
+    if (number_traces < ENOUGH_MEASURE / 4) {
         printf("not enough measurements (%.0f still to go).\n",
-               ENOUGH_MEASURE - number_traces_max_t);
-        return false;
+               ENOUGH_MEASURE - number_traces);
+        return UNDECIDED;
     }
 
     /* max_t: the t statistic value
@@ -106,73 +263,305 @@ static bool report(void)
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
-        return false;
+        return LEAKAGE;
+
+    if (number_traces < ENOUGH_MEASURE)
+        return early_verdict(max_t);
 
     /* Probably not constant time. */
     if (max_t > t_threshold_moderate)
-        return false;
+        return LEAKAGE;
 
     /* For the moment, maybe constant time. */
-    return true;
+    return NO_LEAKAGE;
 }
 
-static bool doit(int mode)
+/* Take one batch of measurements into exec_times and classes. Return false
+ * if the implementation misbehaved.
+ */
+static bool doit(int mode, int64_t *exec_times, uint8_t *classes)
 {
     int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
     uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
+    if (!before_ticks || !after_ticks || !input_data)
         die();
-    }
 
     prepare_inputs(input_data, classes);
 
     bool ret = measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    ret &= report();
 
     free(before_ticks);
     free(after_ticks);
-    free(exec_times);
-    free(classes);
     free(input_data);
 
     return ret;
 }
 
-static void init_once(void)
+/* Measure a few batches to derive the cropping thresholds from */
+static bool calibrate(int mode)
+{
+    int64_t *samples =
+        calloc(CALIBRATION_BATCHES * N_MEASURES, sizeof(int64_t));
+    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
+    if (!samples || !exec_times || !classes)
+        die();
+
+    bool ok = init_dut();
+    size_t n = 0;
+    for (int b = 0; ok && b < CALIBRATION_BATCHES; b++) {
+        ok &= doit(mode, exec_times, classes);
+        for (size_t i = 0; i < N_MEASURES; i++) {
+            if (exec_times[i] > 0)
+                samples[n++] = exec_times[i];
+        }
+    }
+
+    if (n) {
+        qsort(samples, n, sizeof(int64_t), cmp);
+        prepare_percentiles(samples, n);
+    }
+    free_dut();
+
+    free(samples);
+    free(exec_times);
+    free(classes);
+    return ok && n;
+}
+
+/* Run the calling thread on the CPU of w */
+static void pin(const worker_t *w)
+{
+#if defined(__linux__)
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void) w;
+#endif
+}
+
+/* Measure the batches of w in the current round, on the pool of elements of
+ * the calling thread
+ */
+static void run_batches(worker_t *w, int64_t *exec_times, uint8_t *classes)
 {
-    init_dut();
-    t_init(t);
+    for (int i = 0; w->ok && i < w->batches; i++) {
+        w->ok &= doit(w->mode, exec_times, classes);
+        update_statistics(w->t, exec_times, classes);
+    }
+}
+
+/* Thread of every worker but the first, measuring one round after another
+ * until the try is over
+ */
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+    rounds_t *r = w->rounds;
+    exception_block_signals();
+    pin(w);
+
+    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
+    if (!exec_times || !classes)
+        die();
+
+    w->ok &= init_dut();
+    for (int seen = 0;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->round == seen && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        bool stop = r->stop;
+        seen = r->round;
+        pthread_mutex_unlock(&r->lock);
+        if (stop)
+            break;
+
+        run_batches(w, exec_times, classes);
+
+        pthread_mutex_lock(&r->lock);
+        if (!--r->pending)
+            pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    free_dut();
+
+    free(exec_times);
+    free(classes);
+    return NULL;
+}
+
+/* Spread the CPUs this process may run on over the workers. Return how many
+ * workers to run: workers sharing a CPU would only preempt one another in the
+ * middle of measurements, so there are no more of them than CPUs.
+ */
+static int assign_cpus(worker_t *workers, int n)
+{
+    for (int i = 0; i < n; i++)
+        workers[i].cpu = -1;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    if (n < 2 || sched_getaffinity(0, sizeof(set), &set))
+        return n;
+
+    int cpus[CPU_SETSIZE], n_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n_cpus++] = cpu;
+    }
+    if (!n_cpus)
+        return n;
+    if (n > n_cpus)
+        n = n_cpus;
+    for (int i = 0; n > 1 && i < n; i++)
+        workers[i].cpu = cpus[i];
+#endif
+    return n;
+}
+
+/* Measure one round of batches, spread over the workers. The calling thread
+ * does the share of the first worker itself.
+ */
+static void run_round(worker_t *workers,
+                      int n,
+                      int batches,
+                      int64_t *exec_times,
+                      uint8_t *classes)
+{
+    for (int i = 0; i < n; i++)
+        workers[i].batches = batches / n + (i < batches % n);
+
+    rounds_t *r = workers[0].rounds;
+    pthread_mutex_lock(&r->lock);
+    r->pending = n - 1;
+    r->round++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    run_batches(&workers[0], exec_times, classes);
+
+    pthread_mutex_lock(&r->lock);
+    while (r->pending)
+        pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Measure one try, on as many threads as requested, until the verdict is
+ * clear or the budget is spent. Add the number of measurements taken to
+ * *used.
+ */
+static bool measure_all(int mode, double *used)
+{
+    int n = dudect_workers;
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+
+    worker_t *workers = calloc(n, sizeof(worker_t));
+    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
+    if (!workers || !exec_times || !classes)
+        die();
+    rounds_t rounds = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    n = assign_cpus(workers, n);
+    for (int i = 0; i < n; i++) {
+        workers[i].rounds = &rounds;
+        workers[i].mode = mode;
+        workers[i].ok = true;
+        for (int j = 0; j < N_TESTS; j++)
+            t_init(&workers[i].t[j]);
+    }
+
+    pin(&workers[0]);
+    workers[0].ok &= init_dut();
+    /* Go on with the workers started, should starting another one fail */
+    int started = 1;
+    while (started < n && !pthread_create(&workers[started].thread, NULL,
+                                          worker_run, &workers[started]))
+        started++;
+    n = started;
+
+    int budget = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+    verdict_t verdict = UNDECIDED;
+    bool ok = true;
+    for (int done = 0; ok && verdict == UNDECIDED && done < budget;) {
+        int batches = budget - done < ROUND_BATCHES ? budget - done
+                                                    : ROUND_BATCHES;
+        run_round(workers, n, batches, exec_times, classes);
+        done += batches;
+
+        for (int j = 0; j < N_TESTS; j++)
+            t_init(&t[j]);
+        for (int i = 0; i < n; i++) {
+            ok &= workers[i].ok;
+            for (int j = 0; j < N_TESTS; j++)
+                t_merge(&t[j], &workers[i].t[j]);
+        }
+        verdict = report();
+        /* Show the progress, output being otherwise buffered */
+        fflush(stdout);
+    }
+
+    pthread_mutex_lock(&rounds.lock);
+    rounds.stop = true;
+    pthread_cond_broadcast(&rounds.cond);
+    pthread_mutex_unlock(&rounds.lock);
+    for (int i = 1; i < n; i++)
+        pthread_join(workers[i].thread, NULL);
+    free_dut();
+
+    free(workers);
+    free(exec_times);
+    free(classes);
+
+    *used += t[0].n[0] + t[0].n[1];
+    return ok && verdict == NO_LEAKAGE;
 }
 
 static bool test_const(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    t = calloc(N_TESTS, sizeof(t_context_t));
+    if (!t)
+        die();
 
-    for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
+    printf("Testing %s...(calibrating)\n", text);
+    fflush(stdout);
+    bool calibrated = calibrate(mode);
+    printf("\033[A\033[2K");
+    if (!calibrated) {
+        free(t);
+        return false;
+    }
+
+    double used = 0;
+    int cnt;
+    for (cnt = 0; cnt < TEST_TRIES && !result; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
-        init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        fflush(stdout);
+        result = measure_all(mode, &used);
         printf("\033[A\033[2K\033[A\033[2K");
-        if (result)
-            break;
     }
+    printf("Testing %s: %.0f measurements in %d tries\n", text, used, cnt);
     free(t);
     return result;
 }
 
-#define DUT_FUNC_IMPL(op) \
-    bool is_##op##_const(void) { return test_const(#op, DUT(op)); }
+#define DUT_FUNC_IMPL(op, c) \
+    bool is_##op##_##c(void) { return test_const(#op, DUT(op)); }
 
-#define _(x) DUT_FUNC_IMPL(x)
+#define _(x, c) DUT_FUNC_IMPL(x, c)
 DUT_FUNCS
 #undef _
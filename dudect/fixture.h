@@ -4,8 +4,13 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-#define _(x) bool is_##x##_const(void);
+/* Number of threads taking measurements in parallel */
+extern int dudect_workers;
+
+/* Interface to test if function has the expected time complexity, e.g.
+ * is_insert_head_const() or is_sort_linearithmic()
+ */
+#define _(x, c) bool is_##x##_##c(void);
 DUT_FUNCS
 #undef _
 
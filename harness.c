@@ -1,7 +1,10 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,29 +38,54 @@
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
+    struct __shard *shard; /* Shard whose list the block is on */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    _Alignas(max_align_t) unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Allocated blocks are kept track of in shards, one per thread, so that
+ * threads allocating at the same time do not contend for a single list. A
+ * block may be freed by any thread: it records its shard, whose lock guards
+ * the list. When a thread exits, its shard passes on to the next new thread
+ * along with the blocks still on it.
+ */
+typedef struct __shard {
+    pthread_mutex_t lock;
+    block_element_t *blocks;
+    atomic_size_t count; /* Blocks on the list */
+    atomic_bool owned;   /* Taken by a running thread */
+    struct __shard *next;
+} shard_t;
+
+/* Every shard there is, which only ever grows */
+static _Atomic(shard_t *) shards = NULL;
+
+static _Thread_local shard_t *own_shard = NULL;
+
+/* Gives the shard of a thread back when the thread exits */
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+/* Modes are set by the main thread and read by every thread */
+static atomic_bool cautious_mode = true;
+static atomic_bool noallocate_mode = false;
+static atomic_bool error_occurred = false;
+static _Thread_local char *error_message = "";
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, which every thread sets up on its own */
+static _Thread_local jmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
+static _Thread_local bool time_limited = false;
+
+/* SIGALRM is blocked, so this thread cannot have a time limit */
+static _Thread_local bool signals_blocked = false;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -67,6 +95,78 @@ typedef enum {
 
 /* Internal functions */
 
+static void release_shard(void *shard)
+{
+    atomic_store(&((shard_t *) shard)->owned, false);
+}
+
+static void create_shard_key(void)
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+/* Shard of the calling thread, taken over from an exited thread if there is
+ * one, and made otherwise
+ */
+static shard_t *get_shard(void)
+{
+    if (own_shard)
+        return own_shard;
+
+    shard_t *s;
+    for (s = atomic_load(&shards); s; s = s->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&s->owned, &expected, true))
+            break;
+    }
+    if (!s) {
+        s = malloc(sizeof(shard_t));
+        if (!s) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        s->blocks = NULL;
+        atomic_init(&s->count, 0);
+        atomic_init(&s->owned, true);
+        s->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &s->next, s))
+            ;
+    }
+
+    pthread_once(&shard_key_once, create_shard_key);
+    pthread_setspecific(shard_key, s);
+    own_shard = s;
+    return s;
+}
+
+/* Is b a block on the list of shard s? */
+static bool shard_has(shard_t *s, const block_element_t *b)
+{
+    pthread_mutex_lock(&s->lock);
+    const block_element_t *ab = s->blocks;
+    while (ab && ab != b)
+        ab = ab->next;
+    pthread_mutex_unlock(&s->lock);
+    return ab != NULL;
+}
+
+/* Is b an allocated block? The shard of the calling thread, where most
+ * blocks being freed are, is searched first.
+ */
+static bool is_allocated(const block_element_t *b)
+{
+    shard_t *own = own_shard;
+    if (own && shard_has(own, b))
+        return true;
+    for (shard_t *s = atomic_load(&shards); s; s = s->next) {
+        if (s != own && shard_has(s, b))
+            return true;
+    }
+    return false;
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
@@ -88,13 +188,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!is_allocated(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -142,29 +236,32 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
+    shard_t *shard = get_shard();
+    if (!shard)
+        return NULL;
     block_element_t *new_block =
         malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->shard = shard;
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    pthread_mutex_lock(&shard->lock);
+    new_block->next = shard->blocks;
+    if (shard->blocks)
+        shard->blocks->prev = new_block;
+    shard->blocks = new_block;
+    atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
 
     return p;
 }
@@ -211,17 +308,20 @@ void test_free(void *p)
     memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
+    shard_t *shard = b->shard;
+    pthread_mutex_lock(&shard->lock);
     block_element_t *bn = b->next;
     block_element_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        shard->blocks = bn;
     if (bn)
         bn->prev = bp;
+    atomic_fetch_sub_explicit(&shard->count, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -237,7 +337,10 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    for (shard_t *s = atomic_load(&shards); s; s = s->next)
+        count += atomic_load_explicit(&s->count, memory_order_relaxed);
+    return count;
 }
 
 /* Implementation of functions for testing */
@@ -261,9 +364,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -287,13 +388,22 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
+    if (limit_time && !signals_blocked) {
         alarm(time_limit);
         time_limited = true;
     }
     return true;
 }
 
+void exception_block_signals(void)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signals_blocked = true;
+}
+
 /* Call once past risky code */
 void exception_cancel()
 {
@@ -18,7 +18,7 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, by whichever thread */
 size_t allocation_check();
 
 /* Probability of malloc failing, expressed as percent */
@@ -27,6 +27,8 @@ extern int fail_probability;
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
+ * This searches the blocks of every thread, so it is best turned off while
+ * threads free the blocks of others.
  */
 void set_cautious_mode(bool cautious);
 
@@ -39,11 +41,19 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
-/* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+/* Prepare for a risky operation using setjmp, in the calling thread only.
+ * Function returns true for initial return, false for error return.
+ * The time limit is only armed in threads that did not call
+ * exception_block_signals().
  */
 bool exception_setup(bool limit_time);
 
+/* Keep the SIGALRM of a time limit, which goes to any thread of the process,
+ * away from the calling thread. Every thread started besides the main thread
+ * calls this first, so that a time limit always interrupts the main thread.
+ */
+void exception_block_signals(void);
+
 /* Call once past risky code */
 void exception_cancel();
 
@@ -0,0 +1,293 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+
+/* Hazard pointers each thread publishes: the head and its successor */
+#define HAZARDS 2
+
+/* Nodes a thread retires before freeing those no longer hazardous. Past
+ * all the hazard pointers there can be, at least half of them get freed.
+ */
+#define RETIRE_MAX (2 * HAZARDS * MPMC_MAX_THREADS)
+
+typedef struct node {
+    _Atomic(struct node *) next;
+    element_t *e;
+} node_t;
+
+struct mpmc_thread {
+    mpmc_t *q;
+    atomic_bool attached;
+    _Atomic(node_t *) hazard[HAZARDS];
+    int n_retired;
+    node_t *retired[RETIRE_MAX];
+};
+
+struct mpmc {
+    mpmc_kind_t kind;
+
+    /* MPMC_LOCK_FREE */
+    _Atomic(node_t *) head;
+    _Atomic(node_t *) tail;
+
+    /* MPMC_MUTEX */
+    pthread_mutex_t lock;
+    struct list_head list;
+
+    mpmc_thread_t threads[MPMC_MAX_THREADS];
+};
+
+static element_t *new_element(const char *s)
+{
+    element_t *e = malloc(sizeof(element_t));
+    if (!e)
+        return NULL;
+    e->value = strdup(s);
+    if (!e->value) {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void mpmc_release_element(element_t *e)
+{
+    free(e->value);
+    free(e);
+}
+
+static node_t *new_node(element_t *e)
+{
+    node_t *n = malloc(sizeof(node_t));
+    if (!n)
+        return NULL;
+    atomic_init(&n->next, NULL);
+    n->e = e;
+    return n;
+}
+
+mpmc_t *mpmc_new(mpmc_kind_t kind)
+{
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    if (!q)
+        return NULL;
+    q->kind = kind;
+
+    node_t *dummy = NULL;
+    if (kind == MPMC_LOCK_FREE) {
+        dummy = new_node(NULL);
+        if (!dummy) {
+            free(q);
+            return NULL;
+        }
+    } else if (pthread_mutex_init(&q->lock, NULL)) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    INIT_LIST_HEAD(&q->list);
+
+    for (int i = 0; i < MPMC_MAX_THREADS; i++) {
+        mpmc_thread_t *t = &q->threads[i];
+        t->q = q;
+        atomic_init(&t->attached, false);
+        for (int h = 0; h < HAZARDS; h++)
+            atomic_init(&t->hazard[h], NULL);
+        t->n_retired = 0;
+    }
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+
+    if (q->kind == MPMC_MUTEX) {
+        element_t *e, *safe;
+        list_for_each_entry_safe (e, safe, &q->list, list)
+            mpmc_release_element(e);
+        pthread_mutex_destroy(&q->lock);
+    } else {
+        /* The dummy node holds no element, every node past it does */
+        node_t *n = atomic_load(&q->head);
+        node_t *next = atomic_load(&n->next);
+        free(n);
+        for (n = next; n; n = next) {
+            next = atomic_load(&n->next);
+            mpmc_release_element(n->e);
+            free(n);
+        }
+    }
+
+    for (int i = 0; i < MPMC_MAX_THREADS; i++) {
+        mpmc_thread_t *t = &q->threads[i];
+        for (int r = 0; r < t->n_retired; r++)
+            free(t->retired[r]);
+    }
+    free(q);
+}
+
+mpmc_thread_t *mpmc_attach(mpmc_t *q)
+{
+    for (int i = 0; i < MPMC_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&q->threads[i].attached, &expected,
+                                           true))
+            return &q->threads[i];
+    }
+    return NULL;
+}
+
+void mpmc_detach(mpmc_thread_t *t)
+{
+    for (int h = 0; h < HAZARDS; h++)
+        atomic_store(&t->hazard[h], NULL);
+    /* Nodes still retired are left to the next thread in the slot */
+    atomic_store(&t->attached, false);
+}
+
+static bool is_hazard(const mpmc_t *q, const node_t *n)
+{
+    for (int i = 0; i < MPMC_MAX_THREADS; i++) {
+        for (int h = 0; h < HAZARDS; h++) {
+            if (atomic_load(&q->threads[i].hazard[h]) == n)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Free node n once no thread may read it any more */
+static void retire(mpmc_thread_t *t, node_t *n)
+{
+    t->retired[t->n_retired++] = n;
+    if (t->n_retired < RETIRE_MAX)
+        return;
+
+    int kept = 0;
+    for (int r = 0; r < t->n_retired; r++) {
+        if (is_hazard(t->q, t->retired[r]))
+            t->retired[kept++] = t->retired[r];
+        else
+            free(t->retired[r]);
+    }
+    t->n_retired = kept;
+}
+
+/* Load *p and publish it as hazard h of thread t. Return the pointer once it
+ * is known to have still been in *p after publishing it, so that a thread
+ * scanning the hazard pointers afterwards cannot miss it.
+ */
+static node_t *protect(mpmc_thread_t *t, int h, _Atomic(node_t *) *p)
+{
+    node_t *n = atomic_load(p);
+    for (;;) {
+        atomic_store(&t->hazard[h], n);
+        node_t *again = atomic_load(p);
+        if (again == n)
+            return n;
+        n = again;
+    }
+}
+
+static void lock_free_insert(mpmc_thread_t *t, node_t *n)
+{
+    mpmc_t *q = t->q;
+    for (;;) {
+        node_t *tail = protect(t, 0, &q->tail);
+        node_t *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+        if (next) {
+            /* Help the inserting thread that has not swung the tail yet */
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&tail->next, &next, n)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, n);
+            break;
+        }
+    }
+    atomic_store(&t->hazard[0], NULL);
+}
+
+static element_t *lock_free_remove(mpmc_thread_t *t)
+{
+    mpmc_t *q = t->q;
+    node_t *head;
+    element_t *e;
+    for (;;) {
+        head = protect(t, 0, &q->head);
+        node_t *tail = atomic_load(&q->tail);
+        node_t *next = protect(t, 1, &head->next);
+        if (head != atomic_load(&q->head))
+            continue;
+        if (!next) {
+            e = NULL;
+            break;
+        }
+        if (head == tail) {
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+        /* next becomes the dummy node, so its element is taken beforehand */
+        e = next->e;
+        if (atomic_compare_exchange_weak(&q->head, &head, next))
+            break;
+    }
+    atomic_store(&t->hazard[0], NULL);
+    atomic_store(&t->hazard[1], NULL);
+    if (e)
+        retire(t, head);
+    return e;
+}
+
+bool mpmc_insert_tail(mpmc_thread_t *t, const char *s)
+{
+    element_t *e = new_element(s);
+    if (!e)
+        return false;
+
+    mpmc_t *q = t->q;
+    if (q->kind == MPMC_MUTEX) {
+        pthread_mutex_lock(&q->lock);
+        list_add_tail(&e->list, &q->list);
+        pthread_mutex_unlock(&q->lock);
+        return true;
+    }
+
+    node_t *n = new_node(e);
+    if (!n) {
+        mpmc_release_element(e);
+        return false;
+    }
+    lock_free_insert(t, n);
+    return true;
+}
+
+element_t *mpmc_remove_head(mpmc_thread_t *t, char *sp, size_t bufsize)
+{
+    mpmc_t *q = t->q;
+    element_t *e = NULL;
+    if (q->kind == MPMC_MUTEX) {
+        pthread_mutex_lock(&q->lock);
+        if (!list_empty(&q->list)) {
+            e = list_first_entry(&q->list, element_t, list);
+            list_del(&e->list);
+        }
+        pthread_mutex_unlock(&q->lock);
+    } else {
+        e = lock_free_remove(t);
+    }
+
+    if (e && sp) {
+        strncpy(sp, e->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    return e;
+}
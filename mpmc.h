@@ -0,0 +1,92 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/* Unbounded multi-producer, multi-consumer queue of element_t.
+ *
+ * Any number of threads insert at the tail and remove from the head. Two
+ * implementations share the interface, so that they can be compared:
+ *
+ *  - MPMC_LOCK_FREE is the queue of Michael and Scott, a linked list with a
+ *    dummy node at the head that threads swing the head and tail pointers of
+ *    with compare-and-swap. A removed node may still be read by a thread
+ *    that loaded it just before, so it is retired rather than freed, and
+ *    only freed once no thread has published it as a hazard pointer.
+ *
+ *  - MPMC_MUTEX is a list_head queue guarded by a mutex.
+ *
+ * A thread attaches to the queue before using it, which gives it the slot
+ * holding its hazard pointers. Elements and nodes are allocated through the
+ * harness, as with spsc.h.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+/* Most threads attached to a queue at a time */
+#define MPMC_MAX_THREADS 64
+
+typedef enum { MPMC_LOCK_FREE, MPMC_MUTEX } mpmc_kind_t;
+
+typedef struct mpmc mpmc_t;
+typedef struct mpmc_thread mpmc_thread_t;
+
+/**
+ * mpmc_new() - Create an empty queue
+ * @kind: implementation to use
+ *
+ * Return: NULL for allocation failed
+ */
+mpmc_t *mpmc_new(mpmc_kind_t kind);
+
+/**
+ * mpmc_free() - Free the queue along with the elements left in it, no effect
+ * if q is NULL. No thread may be attached any more.
+ * @q: queue to free
+ */
+void mpmc_free(mpmc_t *q);
+
+/**
+ * mpmc_attach() - Attach the calling thread to the queue
+ * @q: queue
+ *
+ * Return: handle for the thread to use the queue through, or NULL if
+ * MPMC_MAX_THREADS threads are attached already
+ */
+mpmc_thread_t *mpmc_attach(mpmc_t *q);
+
+/**
+ * mpmc_detach() - Detach a thread from the queue, giving up its handle
+ * @t: handle of the thread
+ */
+void mpmc_detach(mpmc_thread_t *t);
+
+/**
+ * mpmc_insert_tail() - Insert an element at the tail
+ * @t: handle of the calling thread
+ * @s: string would be inserted, which is copied
+ *
+ * Return: true for success, false for allocation failed
+ */
+bool mpmc_insert_tail(mpmc_thread_t *t, const char *s);
+
+/**
+ * mpmc_remove_head() - Remove the element at the head
+ * @t: handle of the calling thread
+ * @sp: string would be copied, as with q_remove_head()
+ * @bufsize: size of the string
+ *
+ * Return: the removed element, to be released with mpmc_release_element(),
+ * or NULL if the queue is empty
+ */
+element_t *mpmc_remove_head(mpmc_thread_t *t, char *sp, size_t bufsize);
+
+/**
+ * mpmc_release_element() - Release the storage of an element removed from
+ * the queue, in any thread
+ * @e: element to release
+ */
+void mpmc_release_element(element_t *e);
+
+#endif /* LAB0_MPMC_H */
@@ -3,8 +3,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +23,8 @@
 #include <time.h>
 #endif
 
+#include "dudect/complexity.h"
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -43,9 +49,12 @@ extern int show_entropy;
  * solution code
  */
 #include "queue.h"
+#include "mpmc.h"
+#include "spsc.h"
 
 #include "console.h"
 #include "report.h"
+#include "web.h"
 
 /* Settable parameters */
 
@@ -77,7 +86,14 @@ static int descend = 0;
 
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+
+/* Random strings are generated this many at a time */
+#define RANDSTR_BATCH 256
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+/* Seed of the random strings, 0 for a fresh one every run */
+static int randstr_seed_param = 0;
+
 /* For queue_insert and queue_remove */
 typedef enum {
     POS_TAIL,
@@ -163,21 +179,30 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
- */
-static void fill_rand_string(char *buf, size_t buf_size)
+/* Check the time complexity of an operation in simulation mode */
+static bool simulate(bool (*check)(void),
+                     const char *complexity,
+                     int argc,
+                     char *argv[])
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
 
-    buf[len] = '\0';
+    /* Every sample builds and frees a queue of thousands of elements, which
+     * would take quadratic time to free in cautious mode.
+     */
+    set_cautious_mode(false);
+    bool ok = check();
+    set_cautious_mode(true);
+    if (!ok) {
+        report(1, "ERROR: Probably not %s or wrong implementation",
+               complexity);
+        return false;
+    }
+    report(1, "Probably %s", complexity);
+    return ok;
 }
 
 /* insertion */
@@ -200,7 +225,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
+    int randstr_next = RANDSTR_BATCH;
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -216,10 +242,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
     if (!current || !current->q)
         report(3, "Warning: Calling insert %s on null queue",
@@ -228,8 +252,18 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            if (need_rand) {
+                /* Generate no more strings than needed, so that the strings
+                 * for a given seed do not depend on how they are batched.
+                 */
+                if (randstr_next == RANDSTR_BATCH) {
+                    int n = reps - r < RANDSTR_BATCH ? reps - r : RANDSTR_BATCH;
+                    randstr_fill(randstr_buf[0], n, MAX_RANDSTR_LEN, charset,
+                                 MIN_RANDSTR_LEN, MAX_RANDSTR_LEN - 1);
+                    randstr_next = 0;
+                }
+                inserts = randstr_buf[randstr_next++];
+            }
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
@@ -514,6 +548,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(is_reverse_linear, "linear time", argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -535,6 +572,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(is_size_linear, "linear time", argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -578,6 +618,9 @@ static bool do_size(int argc, char *argv[])
 
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(is_sort_linearithmic, "linearithmic time", argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -669,6 +712,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(is_delete_mid_linear, "linear time", argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -913,33 +959,48 @@ static bool do_merge(int argc, char *argv[])
     return ok && !error_check();
 }
 
-static bool is_circular()
+/* Longest output q_show collects before writing it out */
+#define SHOW_BUF_SIZE 4096
+
+static char show_buf[SHOW_BUF_SIZE];
+static size_t show_len = 0;
+
+static void show_reset(void)
+{
+    show_buf[0] = '\0';
+    show_len = 0;
+}
+
+static void show_flush(int vlevel)
 {
-    struct list_head *cur = current->q->next;
-    struct list_head *fast = (cur) ? cur->next : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->next)
-            return false;
-        if (cur == fast)
-            return false;
-        cur = cur->next;
-        fast = fast->next->next;
-    }
+    if (show_len)
+        report_noreturn(vlevel, "%s", show_buf);
+    show_reset();
+}
 
-    cur = current->q->prev;
-    fast = (cur) ? cur->prev : NULL;
-    while (cur != current->q) {
-        if (!cur || !fast || !fast->prev)
-            return false;
-        cur = cur->prev;
-        fast = fast->prev->prev;
+/* Add s to the output of q_show, which is written out once it is full */
+static void show_append(int vlevel, const char *s)
+{
+    size_t len = strlen(s);
+    if (show_len + len >= SHOW_BUF_SIZE) {
+        show_flush(vlevel);
+        if (len >= SHOW_BUF_SIZE) {
+            report_noreturn(vlevel, "%s", s);
+            return;
+        }
     }
-    return true;
+    memcpy(show_buf + show_len, s, len + 1);
+    show_len += len;
 }
 
+/* Display the current queue, checking on the way that it is doubly circular:
+ * the walk must come back to the head after current->size elements, and each
+ * node must be the prev of its next. Checking this along with the display
+ * takes one pass over the queue instead of three.
+ */
 static bool q_show(int vlevel)
 {
-    bool ok = true;
+    bool ok = true, circular = true;
     if (verblevel < vlevel)
         return true;
 
@@ -949,46 +1010,57 @@ static bool q_show(int vlevel)
         return true;
     }
 
-    if (!is_circular()) {
-        report(vlevel, "ERROR:  Queue is not doubly circular");
-        return false;
-    }
-
-    report_noreturn(vlevel, "l = [");
+    show_reset();
+    show_append(vlevel, "l = [");
 
     struct list_head *ori = current->q;
     struct list_head *cur = current->q->next;
+    struct list_head *prev = ori;
+
+    char entropy_buf[16];
 
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < current->size) {
+            if (!cur || cur->prev != prev) {
+                circular = false;
+                break;
+            }
             element_t *e = list_entry(cur, element_t, list);
             if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                if (cnt)
+                    show_append(vlevel, " ");
+                show_append(vlevel, e->value);
                 if (show_entropy) {
-                    report_noreturn(
-                        vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
+                    snprintf(entropy_buf, sizeof(entropy_buf), "(%3.2f%%)",
+                             shannon_entropy((const uint8_t *) e->value));
+                    show_append(vlevel, entropy_buf);
                 }
             }
             cnt++;
+            prev = cur;
             cur = cur->next;
             ok = ok && !error_check();
         }
+        if (ok && circular && cur == ori && ori->prev != prev)
+            circular = false;
     }
     exception_cancel();
 
+    if (ok && !circular) {
+        show_reset();
+        report(vlevel, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
     if (!ok) {
-        report(vlevel, " ... ]");
+        show_append(vlevel, " ... ]");
+        report(vlevel, "%s", show_buf);
         return false;
     }
 
-    if (cur == ori) {
-        if (cnt <= BIG_LIST_SIZE)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
+    show_append(vlevel, cur == ori && cnt <= BIG_LIST_SIZE ? "]" : " ... ]");
+    report(vlevel, "%s", show_buf);
+    if (cur != ori) {
         report(vlevel, "ERROR:  Queue has more than %d elements",
                current->size);
         ok = false;
@@ -997,6 +1069,348 @@ static bool q_show(int vlevel)
     return ok;
 }
 
+/* Commands whose time complexity can be estimated */
+static const struct {
+    const char *name;
+    int mode;
+} complexity_cmds[] = {
+    {"ih", DUT(insert_head)}, {"it", DUT(insert_tail)},
+    {"rh", DUT(remove_head)}, {"rt", DUT(remove_tail)},
+    {"size", DUT(size)},      {"reverse", DUT(reverse)},
+    {"dm", DUT(delete_mid)},  {"sort", DUT(sort)},
+};
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int mode = -1;
+    for (size_t i = 0;
+         i < sizeof(complexity_cmds) / sizeof(complexity_cmds[0]); i++) {
+        if (!strcmp(argv[1], complexity_cmds[i].name))
+            mode = complexity_cmds[i].mode;
+    }
+    if (mode < 0) {
+        report(1, "Cannot estimate complexity of '%s'", argv[1]);
+        return false;
+    }
+
+    int expected = complexity_expected(mode);
+    if (argc == 3) {
+        expected = complexity_model(argv[2]);
+        if (expected < 0) {
+            report(1, "Unknown model '%s'", argv[2]);
+            return false;
+        }
+    }
+
+    complexity_t r;
+    bool ok = false;
+    set_cautious_mode(false);
+    if (exception_setup(false))
+        ok = complexity_estimate(mode, &r);
+    exception_cancel();
+    set_cautious_mode(true);
+    if (!ok) {
+        report(1, "ERROR: Wrong implementation of %s", argv[1]);
+        return false;
+    }
+
+    report(2, "%8s %14s", "n", "cycles");
+    for (int i = 0; i < r.n_sizes; i++)
+        report(2, "%8.0f %14.0f", r.sizes[i], r.cycles[i]);
+    for (int m = 0; m < N_MODELS; m++)
+        report(2, "O(%s): error %.3f", complexity_model_desc(m), r.error[m]);
+    report(1, "%s: O(%s), confidence %.2f, log-log slope %.2f", argv[1],
+           complexity_model_desc(r.best), r.confidence, r.slope);
+
+    if (r.best != expected) {
+        report(1, "ERROR: Expected O(%s)", complexity_model_desc(expected));
+        return false;
+    }
+    return true;
+}
+
+/* Elements passed from one thread to the other by default, and the default
+ * capacity of the queue
+ */
+#define SPSC_ELEMENTS 1000000
+#define SPSC_CAPACITY 1024
+
+/* Times a thread retries on a full or empty queue before yielding the CPU */
+#define SPSC_SPINS 64
+
+typedef struct {
+    spsc_t *q;
+    int n;
+    atomic_bool stop; /* Set once the producer gives up */
+    bool produced;
+    bool consumed;
+} spsc_run_t;
+
+/* Insert the strings "0", "1", ... in turn */
+static void *spsc_producer(void *arg)
+{
+    spsc_run_t *run = arg;
+    char s[16];
+    exception_block_signals();
+    run->produced = true;
+    for (int i = 0; i < run->n && run->produced; i++) {
+        snprintf(s, sizeof(s), "%d", i);
+        for (int spins = 0; !spsc_insert_tail(run->q, s); spins++) {
+            if (!spsc_full(run->q)) {
+                run->produced = false;
+                break;
+            }
+            if (spins >= SPSC_SPINS)
+                sched_yield();
+        }
+    }
+    atomic_store(&run->stop, true);
+    return NULL;
+}
+
+/* Remove the strings, checking they come out in the order inserted */
+static void *spsc_consumer(void *arg)
+{
+    spsc_run_t *run = arg;
+    char expected[16], sp[16];
+    exception_block_signals();
+    run->consumed = true;
+    for (int i = 0; i < run->n; i++) {
+        element_t *e;
+        for (int spins = 0; !(e = spsc_remove_head(run->q, sp, sizeof(sp)));
+             spins++) {
+            if (atomic_load(&run->stop) && spsc_empty(run->q))
+                return NULL;
+            if (spins >= SPSC_SPINS)
+                sched_yield();
+        }
+        snprintf(expected, sizeof(expected), "%d", i);
+        if (strcmp(sp, expected))
+            run->consumed = false;
+        spsc_release_element(e);
+    }
+    return NULL;
+}
+
+/* Check that the blocks allocated by a run of threads are freed again */
+static bool blocks_freed(size_t bcnt)
+{
+    size_t left = allocation_check();
+    if (left == bcnt)
+        return true;
+    report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
+           (unsigned long) (left - bcnt));
+    return false;
+}
+
+static bool do_spsc(int argc, char *argv[])
+{
+    int n = SPSC_ELEMENTS, capacity = SPSC_CAPACITY;
+    if (argc > 3) {
+        report(1, "%s takes at most 2 arguments", argv[0]);
+        return false;
+    }
+    if (argc > 1 && (!get_int(argv[1], &n) || n < 0)) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+    if (argc > 2 && (!get_int(argv[2], &capacity) || capacity < 1)) {
+        report(1, "Invalid capacity '%s'", argv[2]);
+        return false;
+    }
+
+    /* Elements are freed by the consumer while the producer allocates more,
+     * which searching the blocks in cautious mode would hold up.
+     */
+    size_t bcnt = allocation_check();
+    set_cautious_mode(false);
+    spsc_run_t run = {.q = spsc_new(capacity), .n = n};
+    if (!run.q) {
+        set_cautious_mode(true);
+        report(1, "ERROR: Could not allocate queue of %d elements", capacity);
+        return false;
+    }
+    atomic_init(&run.stop, false);
+
+    pthread_t producer, consumer;
+    double start, elapsed = 0;
+    bool started = false;
+    init_time(&start);
+    if (pthread_create(&consumer, NULL, spsc_consumer, &run)) {
+        report(1, "ERROR: Could not start consumer thread");
+    } else if (pthread_create(&producer, NULL, spsc_producer, &run)) {
+        atomic_store(&run.stop, true);
+        pthread_join(consumer, NULL);
+        report(1, "ERROR: Could not start producer thread");
+    } else {
+        pthread_join(producer, NULL);
+        pthread_join(consumer, NULL);
+        elapsed = delta_time(&start);
+        started = true;
+    }
+    spsc_free(run.q);
+    set_cautious_mode(true);
+
+    if (!blocks_freed(bcnt) || !started)
+        return false;
+    if (!run.produced) {
+        report(1, "ERROR: Could not allocate element");
+        return false;
+    }
+    if (!run.consumed) {
+        report(1, "ERROR: Elements removed out of order");
+        return false;
+    }
+    report(1, "spsc: %d elements in %.3f s, %.1f ns each, %.2f M/s", n,
+           elapsed, n ? elapsed * 1e9 / n : 0,
+           elapsed > 0 ? n / elapsed / 1e6 : 0);
+    return true;
+}
+
+typedef struct {
+    mpmc_t *q;
+    bool insert; /* Insert elements, or else remove them */
+    int ops;
+    atomic_bool *start; /* Set once all threads are there */
+    int64_t cycles;     /* Total cycles spent in operations */
+    int64_t max_cycles; /* Cycles of the slowest operation */
+    bool ok;
+} mt_worker_t;
+
+static void *mt_worker(void *arg)
+{
+    mt_worker_t *w = arg;
+    mpmc_thread_t *t = mpmc_attach(w->q);
+    char s[16], sp[16];
+    exception_block_signals();
+
+    w->ok = t != NULL;
+    w->cycles = w->max_cycles = 0;
+    while (!atomic_load(w->start))
+        sched_yield();
+    for (int i = 0; w->ok && i < w->ops; i++) {
+        snprintf(s, sizeof(s), "%d", i);
+        element_t *e = NULL;
+        int64_t before = cpucycles();
+        if (w->insert)
+            w->ok = mpmc_insert_tail(t, s);
+        else
+            w->ok = (e = mpmc_remove_head(t, sp, sizeof(sp)));
+        int64_t cycles = cpucycles() - before;
+        if (e)
+            mpmc_release_element(e);
+        w->cycles += cycles;
+        if (cycles > w->max_cycles)
+            w->max_cycles = cycles;
+    }
+    if (t)
+        mpmc_detach(t);
+    return NULL;
+}
+
+static bool do_mt(int argc, char *argv[])
+{
+    if (argc != 4 && argc != 5) {
+        report(1, "%s needs 3-4 arguments", argv[0]);
+        return false;
+    }
+
+    bool insert = !strcmp(argv[1], "it");
+    if (!insert && strcmp(argv[1], "rh")) {
+        report(1, "Cannot run '%s' concurrently", argv[1]);
+        return false;
+    }
+    int threads, ops;
+    if (!get_int(argv[2], &threads) || threads < 1 ||
+        threads > MPMC_MAX_THREADS) {
+        report(1, "Invalid number of threads '%s'", argv[2]);
+        return false;
+    }
+    if (!get_int(argv[3], &ops) || ops < 0) {
+        report(1, "Invalid number of operations '%s'", argv[3]);
+        return false;
+    }
+    mpmc_kind_t kind = MPMC_LOCK_FREE;
+    if (argc == 5) {
+        if (!strcmp(argv[4], "mutex")) {
+            kind = MPMC_MUTEX;
+        } else if (strcmp(argv[4], "lockfree")) {
+            report(1, "Unknown implementation '%s'", argv[4]);
+            return false;
+        }
+    }
+
+    /* As with spsc, blocks are freed away from the thread allocating them */
+    size_t bcnt = allocation_check();
+    set_cautious_mode(false);
+    mpmc_t *q = mpmc_new(kind);
+    if (!q) {
+        set_cautious_mode(true);
+        report(1, "ERROR: Could not allocate queue");
+        return false;
+    }
+
+    bool ok = true;
+    if (!insert) {
+        /* Every thread has its share of elements to remove */
+        mpmc_thread_t *t = mpmc_attach(q);
+        for (int i = 0; ok && i < threads * ops; i++)
+            ok = mpmc_insert_tail(t, "mt");
+        mpmc_detach(t);
+    }
+
+    pthread_t tids[MPMC_MAX_THREADS];
+    mt_worker_t workers[MPMC_MAX_THREADS];
+    atomic_bool start;
+    atomic_init(&start, false);
+    int started = 0;
+    for (; ok && started < threads; started++) {
+        workers[started] = (mt_worker_t){
+            .q = q, .insert = insert, .ops = ops, .start = &start};
+        if (pthread_create(&tids[started], NULL, mt_worker,
+                           &workers[started]))
+            break;
+    }
+    if (started < threads) {
+        /* Let the threads started finish with nothing to do */
+        for (int i = 0; i < started; i++)
+            workers[i].ops = 0;
+        ok = false;
+    }
+
+    double t_start;
+    init_time(&t_start);
+    atomic_store(&start, true);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        ok = ok && workers[i].ok;
+    }
+    double elapsed = delta_time(&t_start);
+    mpmc_free(q);
+    set_cautious_mode(true);
+
+    if (!blocks_freed(bcnt))
+        return false;
+    if (!ok) {
+        report(1, "ERROR: Could not run %d threads on the queue", threads);
+        return false;
+    }
+
+    for (int i = 0; i < threads; i++)
+        report(2, "thread %d: %.0f cycles/op mean, %" PRId64 " max", i,
+               ops ? (double) workers[i].cycles / ops : 0,
+               workers[i].max_cycles);
+    double total = (double) threads * ops;
+    report(1, "mt %s: %d threads, %.0f ops in %.3f s, %.2f M ops/s", argv[1],
+           threads, total, elapsed, elapsed > 0 ? total / elapsed / 1e6 : 0);
+    return true;
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1056,6 +1470,35 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Report queue and allocator state on /metrics */
+static void queue_metrics(void)
+{
+    web_metrics_printf(
+        "# HELP qtest_queues Number of queues in the chain.\n"
+        "# TYPE qtest_queues gauge\n"
+        "qtest_queues %d\n"
+        "# HELP qtest_current_queue_size Elements in the current queue.\n"
+        "# TYPE qtest_current_queue_size gauge\n"
+        "qtest_current_queue_size %d\n"
+        "# HELP qtest_allocated_blocks Blocks allocated and not yet freed.\n"
+        "# TYPE qtest_allocated_blocks gauge\n"
+        "qtest_allocated_blocks %zu\n",
+        chain.size, current ? current->size : 0, allocation_check());
+}
+
+/* Queue state recorded in the structured log around every command */
+static void queue_probe(int *size, long *blocks)
+{
+    *size = current ? current->size : -1;
+    *blocks = allocation_check();
+}
+
+static void randstr_seed_changed(int oldval)
+{
+    (void) oldval;
+    randstr_seed((uint32_t) randstr_seed_param);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1096,6 +1539,17 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(spsc,
+                "Pass n elements from a producer to a consumer thread "
+                "through a lock-free queue",
+                "[n] [capacity]");
+    ADD_COMMAND(mt,
+                "Run threads doing ops insertions or removals each on a "
+                "concurrent queue",
+                "it|rh threads ops [lockfree|mutex]");
+    ADD_COMMAND(complexity,
+                "Estimate time complexity of cmd, failing unless it is model",
+                "cmd [model]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1104,6 +1558,13 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("seed", &randstr_seed_param,
+              "Seed of random strings (0: different every run)",
+              randstr_seed_changed);
+    add_param("workers", &dudect_workers,
+              "Number of threads measuring in simulation mode", NULL);
+    web_add_metrics(queue_metrics);
+    set_probe(queue_probe);
 }
 
 /* Signal handlers */
@@ -1149,6 +1610,8 @@ static bool q_quit(int argc, char *argv[])
             chain.size--;
         }
     }
+    /* The jsonlog probe still looks at the queue once quit is done */
+    current = NULL;
 
     exception_cancel();
     set_cautious_mode(true);
@@ -1165,9 +1628,10 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-b BFILE][-v VLEVEL][-l LFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Replay commands from binary trace BFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
     exit(0);
@@ -1379,10 +1843,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char bbuf[BUFSIZE];
+    char *trace_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:b:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1392,6 +1858,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            trace_name = bbuf;
+            break;
         case 'v': {
             char *endptr;
             errno = 0;
@@ -1414,6 +1885,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (infile_name && trace_name) {
+        fprintf(stderr, "Options -f and -b cannot be used together\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* A better seed can be obtained by combining getpid() and its parent ID
      * with the Unix time.
      */
@@ -1424,7 +1900,7 @@ int main(int argc, char *argv[])
     console_init();
 
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !trace_name) {
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
@@ -1441,7 +1917,10 @@ int main(int argc, char *argv[])
     add_quit_helper(q_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (trace_name)
+        ok = ok && run_trace(trace_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
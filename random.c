@@ -28,6 +28,9 @@
 #define _GNU_SOURCE
 #endif
 
+#include <stdbool.h>
+#include <string.h>
+
 #include "random.h"
 
 #if defined(__linux__) || defined(__GNU__)
@@ -264,7 +267,7 @@ static int bsd_randombytes(void *buf, size_t n)
     /* We prefer CCRandomGenerateBytes as it returns an error code while
      * arc4random_buf may fail silently on macOS.
      */
-    return (CCRandomGenerateBytes(buf, n) == kCCSuccess);
+    return CCRandomGenerateBytes(buf, n) == kCCSuccess ? 0 : -1;
 #else
     arc4random_buf(buf, n);
     return 0;
@@ -272,7 +275,10 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Fill buf from the entropy source of the operating system. Return 0 for
+ * success, -1 for failure.
+ */
+static int os_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +297,225 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Asking the operating system for every few bytes costs a system call each
+ * time. Instead, every thread seeds a ChaCha20 stream from it once and hands
+ * out bytes from a buffer of keystream.
+ *
+ * Each refill computes CHACHA_BLOCKS blocks and immediately overwrites the key
+ * with the start of the output ("fast key erasure"), so that bytes already
+ * handed out cannot be recovered from the state.
+ */
+#define CHACHA_BLOCKS 16
+#define CHACHA_BUFSIZE (CHACHA_BLOCKS * 64)
+#define CHACHA_KEYSIZE 32
+
+/* Refills after which the key is drawn from the operating system again */
+#define CHACHA_RESEED 16384
+
+typedef struct {
+    uint32_t key[8];
+    uint8_t buf[CHACHA_BUFSIZE];
+    size_t pos; /* Next unused byte of buf */
+    unsigned refills;
+    bool seeded;
+} chacha_rng_t;
+
+static _Thread_local chacha_rng_t rng;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+/* Compute ChaCha20 block number counter under key, with a zero nonce */
+static void chacha20_block(const uint32_t key[8],
+                           uint32_t counter,
+                           uint8_t *out)
+{
+    const uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, key[0], key[1],
+        key[2],     key[3],     key[4],     key[5],     key[6], key[7],
+        counter,    0,          0,          0,
+    };
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static int chacha_refill(void)
+{
+    if (!rng.seeded || rng.refills >= CHACHA_RESEED) {
+        if (os_randombytes((uint8_t *) rng.key, sizeof(rng.key)))
+            return -1;
+        rng.seeded = true;
+        rng.refills = 0;
+    }
+
+    for (uint32_t i = 0; i < CHACHA_BLOCKS; i++)
+        chacha20_block(rng.key, i, rng.buf + 64 * i);
+    memcpy(rng.key, rng.buf, CHACHA_KEYSIZE);
+    memset(rng.buf, 0, CHACHA_KEYSIZE);
+    rng.pos = CHACHA_KEYSIZE;
+    rng.refills++;
+    return 0;
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    while (n > 0) {
+        if (!rng.seeded || rng.pos == CHACHA_BUFSIZE) {
+            if (chacha_refill())
+                return -1;
+        }
+        size_t chunk = CHACHA_BUFSIZE - rng.pos;
+        if (chunk > n)
+            chunk = n;
+        memcpy(buf, rng.buf + rng.pos, chunk);
+        /* Bytes handed out are not kept around either */
+        memset(rng.buf + rng.pos, 0, chunk);
+        rng.pos += chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+uint8_t randombit(void)
+{
+    static _Thread_local uint64_t bits;
+    static _Thread_local int n_bits = 0;
+
+    if (!n_bits) {
+        randombytes((uint8_t *) &bits, sizeof(bits));
+        n_bits = 64;
+    }
+    uint8_t ret = bits & 1;
+    bits >>= 1;
+    n_bits--;
+    return ret;
+}
+
+/* Random strings come from xoshiro256** instead, which is much cheaper than
+ * ChaCha20 and can be seeded for reproducible runs. RAND_LANES independent
+ * generators are stepped side by side, with their state laid out so that the
+ * compiler can keep each word of it in a vector register.
+ */
+#define RAND_LANES 4
+#define RAND_ROUNDS 8
+#define RAND_OUTPUTS (2 * RAND_LANES * RAND_ROUNDS)
+
+static _Thread_local struct {
+    uint64_t s[4][RAND_LANES];
+    uint32_t out[RAND_OUTPUTS];
+    size_t pos; /* Next unused value of out */
+    bool seeded;
+} lanes;
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static void lanes_refill(void)
+{
+    for (int r = 0; r < RAND_ROUNDS; r++) {
+        uint64_t *s0 = lanes.s[0], *s1 = lanes.s[1];
+        uint64_t *s2 = lanes.s[2], *s3 = lanes.s[3];
+        uint64_t v[RAND_LANES];
+        for (int k = 0; k < RAND_LANES; k++) {
+            v[k] = ROTL64(s1[k] * 5, 7) * 9;
+            uint64_t t = s1[k] << 17;
+            s2[k] ^= s0[k];
+            s3[k] ^= s1[k];
+            s1[k] ^= s2[k];
+            s0[k] ^= s3[k];
+            s2[k] ^= t;
+            s3[k] = ROTL64(s3[k], 45);
+        }
+        for (int k = 0; k < RAND_LANES; k++) {
+            lanes.out[2 * (r * RAND_LANES + k)] = v[k];
+            lanes.out[2 * (r * RAND_LANES + k) + 1] = v[k] >> 32;
+        }
+    }
+    lanes.pos = 0;
+}
+
+static inline uint32_t lanes_next(void)
+{
+    if (lanes.pos == RAND_OUTPUTS)
+        lanes_refill();
+    return lanes.out[lanes.pos++];
+}
+
+/* Map x uniformly onto [0, range) with a multiplication instead of a
+ * division, see
+ * https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+ */
+static inline uint32_t reduce(uint32_t x, uint32_t range)
+{
+    return ((uint64_t) x * range) >> 32;
+}
+
+void randstr_seed(uint64_t seed)
+{
+    if (!seed)
+        randombytes((uint8_t *) &seed, sizeof(seed));
+
+    /* Expand the seed with SplitMix64, which never yields an all-zero state */
+    for (int k = 0; k < RAND_LANES; k++) {
+        for (int w = 0; w < 4; w++) {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            lanes.s[w][k] = z ^ (z >> 31);
+        }
+    }
+    lanes.pos = RAND_OUTPUTS;
+    lanes.seeded = true;
+}
+
+void randstr_fill(char *buf,
+                  size_t n,
+                  size_t stride,
+                  const char *charset,
+                  size_t min_len,
+                  size_t max_len)
+{
+    if (!lanes.seeded)
+        randstr_seed(0);
+
+    uint32_t charset_len = strlen(charset);
+    uint32_t lens = max_len - min_len + 1;
+    for (size_t i = 0; i < n; i++, buf += stride) {
+        size_t len = min_len + reduce(lanes_next(), lens);
+        for (size_t j = 0; j < len; j++)
+            buf[j] = charset[reduce(lanes_next(), charset_len)];
+        buf[len] = '\0';
+    }
+}
@@ -4,14 +4,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Fill buf with len cryptographically secure random bytes. They come from a
+ * per-thread buffer that is refilled from a ChaCha20 stream, seeded by the
+ * operating system. Return 0 if successful.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
-static inline uint8_t randombit(void)
-{
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
-}
+/* Return a single random bit, taken from a per-thread cache of random bytes */
+extern uint8_t randombit(void);
+
+/* Seed the generator behind randstr_fill. The same nonzero seed yields the
+ * same strings, while 0 picks a seed with randombytes.
+ */
+void randstr_seed(uint64_t seed);
+
+/* Fill n strings, stride bytes apart from each other in buf, with characters
+ * of charset. Their lengths are uniform in [min_len, max_len], where max_len
+ * must be less than stride. This is not cryptographically secure.
+ */
+void randstr_fill(char *buf,
+                  size_t n,
+                  size_t stride,
+                  const char *charset,
+                  size_t min_len,
+                  size_t max_len);
 
 #if INTPTR_MAX == INT64_MAX
 #define M_INTPTR_SHIFT (3)
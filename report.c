@@ -1,3 +1,5 @@
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -14,15 +16,61 @@
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
+/* Output is buffered in userspace and only written out by report_flush(),
+ * or once this much of it has piled up
+ */
+#define REPORT_BUF_SIZE (1 << 16)
+
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static FILE *jsonfile = NULL;
+
+/* Errors raised by the command being executed, as JSON strings separated by
+ * commas, until jsonlog_command() writes them out
+ */
+#define JSON_ERRORS_SIZE 4096
+static char json_errors[JSON_ERRORS_SIZE];
+static size_t json_errors_len = 0;
+
+/* Commands being executed, as repeat runs others within itself. Errors raised
+ * when there is none get a line of their own.
+ */
+static int json_depth = 0;
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
     verbfile = vfile;
+    setvbuf(vfile, NULL, _IOFBF, REPORT_BUF_SIZE);
+    if (efile != vfile)
+        setvbuf(efile, NULL, _IOFBF, REPORT_BUF_SIZE);
+}
+
+/* Threads of the spsc, mt and simulation commands report allocation errors
+ * of the harness while the main thread may be reporting too. Writing out a
+ * message, and the buffers of the json log, are serialized by this lock.
+ */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void flush_files(void)
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (errfile && errfile != verbfile)
+        fflush(errfile);
+    if (logfile)
+        fflush(logfile);
+    if (jsonfile)
+        fflush(jsonfile);
+}
+
+void report_flush(void)
+{
+    pthread_mutex_lock(&report_lock);
+    flush_files();
+    pthread_mutex_unlock(&report_lock);
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
@@ -32,6 +80,7 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
         fputs(fail_buf, logfile);
@@ -48,7 +97,148 @@ void set_verblevel(int level)
 bool set_logfile(const char *file_name)
 {
     logfile = fopen(file_name, "w");
-    return logfile != NULL;
+    if (!logfile)
+        return false;
+    setvbuf(logfile, NULL, _IOFBF, REPORT_BUF_SIZE);
+    return true;
+}
+
+bool set_jsonlog(const char *file_name)
+{
+    if (jsonfile)
+        fclose(jsonfile);
+    jsonfile = fopen(file_name, "w");
+    if (!jsonfile)
+        return false;
+    setvbuf(jsonfile, NULL, _IOFBF, REPORT_BUF_SIZE);
+    json_errors_len = 0;
+    return true;
+}
+
+bool jsonlog_enabled(void)
+{
+    return jsonfile != NULL;
+}
+
+#define JSON_LITERAL(s) fwrite(s, 1, sizeof(s) - 1, jsonfile)
+
+/* Escape c as part of a JSON string into out, which has room for 6 bytes.
+ * Return the length written.
+ */
+static size_t json_escape(char *out, unsigned char c)
+{
+    static const char hex[] = "0123456789abcdef";
+    if (c == '"' || c == '\\') {
+        out[0] = '\\';
+        out[1] = c;
+        return 2;
+    }
+    /* Bytes beyond ASCII are taken as Latin-1, which is always valid */
+    if (c < 0x20 || c >= 0x80) {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 0xf];
+        return 6;
+    }
+    out[0] = c;
+    return 1;
+}
+
+static void json_string(const char *s)
+{
+    char out[6];
+    fputc('"', jsonfile);
+    for (; *s; s++)
+        fwrite(out, 1, json_escape(out, *s), jsonfile);
+    fputc('"', jsonfile);
+}
+
+/* Keep an error for the log entry of the command being executed. Errors not
+ * fitting in json_errors any more are left out.
+ */
+static void json_error(const char *prefix, const char *fmt, va_list ap)
+{
+    char msg[MAX_CHAR];
+    snprintf(msg, sizeof(msg), "%s", prefix);
+    size_t n = strlen(msg);
+    vsnprintf(msg + n, sizeof(msg) - n, fmt, ap);
+
+    /* Separator, quotes and the escaped message */
+    size_t len = json_errors_len ? 3 : 2;
+    char escaped[6];
+    for (const char *c = msg; *c; c++)
+        len += json_escape(escaped, *c);
+    if (json_errors_len + len > JSON_ERRORS_SIZE)
+        return;
+
+    char *dst = json_errors + json_errors_len;
+    if (json_errors_len)
+        *dst++ = ',';
+    *dst++ = '"';
+    for (const char *c = msg; *c; c++)
+        dst += json_escape(dst, *c);
+    *dst = '"';
+    json_errors_len += len;
+}
+
+void jsonlog_begin(void)
+{
+    pthread_mutex_lock(&report_lock);
+    json_depth++;
+    pthread_mutex_unlock(&report_lock);
+}
+
+void jsonlog_command(int argc,
+                     char *argv[],
+                     int64_t ns,
+                     int size_before,
+                     int size_after,
+                     long alloc_delta,
+                     bool ok)
+{
+    pthread_mutex_lock(&report_lock);
+    if (json_depth > 0)
+        json_depth--;
+    if (!jsonfile) {
+        pthread_mutex_unlock(&report_lock);
+        return;
+    }
+
+    JSON_LITERAL("{\"cmd\":");
+    json_string(argc ? argv[0] : "");
+    JSON_LITERAL(",\"args\":[");
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            fputc(',', jsonfile);
+        json_string(argv[i]);
+    }
+    fprintf(jsonfile, "],\"ns\":%" PRId64, ns);
+    /* A size below 0 means there is no queue */
+    if (size_before < 0)
+        JSON_LITERAL(",\"size_before\":null");
+    else
+        fprintf(jsonfile, ",\"size_before\":%d", size_before);
+    if (size_after < 0)
+        JSON_LITERAL(",\"size_after\":null");
+    else
+        fprintf(jsonfile, ",\"size_after\":%d", size_after);
+    fprintf(jsonfile, ",\"alloc_delta\":%ld,\"errors\":[", alloc_delta);
+    fwrite(json_errors, 1, json_errors_len, jsonfile);
+    if (ok)
+        JSON_LITERAL("],\"ok\":true}\n");
+    else
+        JSON_LITERAL("],\"ok\":false}\n");
+    json_errors_len = 0;
+    pthread_mutex_unlock(&report_lock);
+}
+
+/* Copy output to the web client whose command is being executed */
+static void web_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    web_vprintf(fmt, ap);
+    va_end(ap);
 }
 
 void report_event(message_t msg, char *fmt, ...)
@@ -65,8 +255,24 @@ void report_event(message_t msg, char *fmt, ...)
     if (msg < N_MSG)
         msg_name = msg_name_text[msg];
     int level = N_MSG - msg - 1;
-    if (verblevel < level)
+    pthread_mutex_lock(&report_lock);
+    if (jsonfile) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "%s: ", msg_name);
+        va_start(ap, fmt);
+        json_error(prefix, fmt, ap);
+        va_end(ap);
+        if (!json_depth) {
+            JSON_LITERAL("{\"cmd\":null,\"errors\":[");
+            fwrite(json_errors, 1, json_errors_len, jsonfile);
+            JSON_LITERAL("]}\n");
+            json_errors_len = 0;
+        }
+    }
+    if (verblevel < level) {
+        pthread_mutex_unlock(&report_lock);
         return;
+    }
 
     if (!errfile)
         init_files(stdout, stdout);
@@ -75,7 +281,12 @@ void report_event(message_t msg, char *fmt, ...)
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
     fprintf(errfile, "\n");
-    fflush(errfile);
+    va_end(ap);
+
+    va_start(ap, fmt);
+    web_printf("%s: ", msg_name);
+    web_vprintf(fmt, ap);
+    web_printf("\n");
     va_end(ap);
 
     if (logfile) {
@@ -83,10 +294,16 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "Error: ");
         vfprintf(logfile, fmt, ap);
         fprintf(logfile, "\n");
-        fflush(logfile);
         va_end(ap);
+    }
+
+    /* Errors are shown right away, along with everything before them */
+    flush_files();
+    if (logfile) {
         fclose(logfile);
+        logfile = NULL;
     }
+    pthread_mutex_unlock(&report_lock);
 
     if (fatal) {
         if (fatal_fun)
@@ -95,67 +312,63 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
 void report(int level, char *fmt, ...)
 {
+    pthread_mutex_lock(&report_lock);
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
+    /* Commands report their failures as messages starting with ERROR */
+    if (jsonfile && !strncmp(fmt, "ERROR", 5)) {
+        va_list ap;
+        va_start(ap, fmt);
+        json_error("", fmt, ap);
+        va_end(ap);
+    }
+
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
             fprintf(logfile, "\n");
-            fflush(logfile);
             va_end(ap);
         }
         va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        web_vprintf(fmt, ap);
         va_end(ap);
+        web_printf("\n");
     }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
-    }
+    pthread_mutex_unlock(&report_lock);
 }
 
 void report_noreturn(int level, char *fmt, ...)
 {
+    pthread_mutex_lock(&report_lock);
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fflush(logfile);
             va_end(ap);
         }
         va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
+        web_vprintf(fmt, ap);
         va_end(ap);
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+    pthread_mutex_unlock(&report_lock);
 }
 
 /* Functions denoting failures */
@@ -167,6 +380,7 @@ static void fail_fun(const char *format, const char *msg)
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
     /* Use write to avoid any buffering issues */
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
     if (logfile) {
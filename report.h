@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -14,6 +15,24 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Structured log, with one JSON object per command executed */
+bool set_jsonlog(const char *file_name);
+bool jsonlog_enabled(void);
+
+/* Mark the start of a command, whose errors are kept for its log entry */
+void jsonlog_begin(void);
+
+/* Log a command that took ns nanoseconds, along with the errors reported
+ * since jsonlog_begin(). A queue size below 0 means there was no queue.
+ */
+void jsonlog_command(int argc,
+                     char *argv[],
+                     int64_t ns,
+                     int size_before,
+                     int size_after,
+                     long alloc_delta,
+                     bool ok);
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -26,6 +45,11 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Write out everything reported so far. Output is otherwise buffered. Done
+ * after every command and before waiting for input; not async-signal-safe.
+ */
+void report_flush(void);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
@@ -0,0 +1,109 @@
+/* Generate the lookup table of log2_lshift16() into log2_table.h
+ *
+ * The function is a step function of its argument. Arguments are split into
+ * buckets by their bit length and the LOG2_MANTISSA_BITS bits following the
+ * leading one, so every bucket is at most 1/16 of an octave wide. The steps
+ * lie further apart than that, so a bucket holds at most one of them, and a
+ * table entry is the value at the start of the bucket together with where in
+ * the bucket it goes up by one.
+ *
+ * Usage: gen-log2-table > log2_table.h
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Mantissa bits indexing the table below the leading one */
+#define LOG2_MANTISSA_BITS 4
+
+/* Arguments are at most 1 << LOG2_ARG_BITS */
+#define LOG2_ARG_BITS 16
+
+/* log2_lshift16(x) is the value of the last breakpoint at or below x */
+static const struct {
+    uint32_t x;
+    int value;
+} breakpoints[] = {
+    {0, -136},     {1, -123},     {2, -117},     {3, -113},     {4, -110},
+    {5, -108},     {6, -106},     {7, -104},     {8, -103},     {9, -102},
+    {10, -100},    {11, -99},     {12, -98},     {13, -97},     {15, -96},
+    {16, -95},     {17, -94},     {19, -93},     {21, -92},     {23, -91},
+    {25, -90},     {27, -89},     {29, -88},     {32, -87},     {35, -86},
+    {38, -85},     {41, -84},     {45, -83},     {49, -82},     {54, -81},
+    {59, -80},     {64, -79},     {70, -78},     {76, -77},     {83, -76},
+    {91, -75},     {99, -74},     {108, -73},    {117, -72},    {128, -71},
+    {140, -70},    {152, -69},    {166, -68},    {181, -67},    {197, -66},
+    {215, -65},    {235, -64},    {256, -63},    {279, -62},    {304, -61},
+    {332, -60},    {362, -59},    {395, -58},    {431, -57},    {470, -56},
+    {512, -55},    {558, -54},    {609, -53},    {664, -52},    {724, -51},
+    {790, -50},    {861, -49},    {939, -48},    {1024, -47},   {1117, -46},
+    {1218, -45},   {1328, -44},   {1448, -43},   {1579, -42},   {1722, -41},
+    {1878, -40},   {2048, -39},   {2233, -38},   {2435, -37},   {2656, -36},
+    {2896, -35},   {3158, -34},   {3444, -33},   {3756, -32},   {4096, -31},
+    {4467, -30},   {4871, -29},   {5312, -28},   {5793, -27},   {6317, -26},
+    {6889, -25},   {7512, -24},   {8192, -23},   {8933, -22},   {9742, -21},
+    {10624, -20},  {11585, -19},  {12634, -18},  {13777, -17},  {15024, -16},
+    {16384, -15},  {17867, -14},  {19484, -13},  {21247, -12},  {23170, -11},
+    {25268, -10},  {27554, -9},   {30048, -8},   {32768, -7},   {35734, -6},
+    {38968, -5},   {42495, -4},   {46341, -3},   {50535, -2},   {55109, -1},
+    {60097, 0},
+};
+
+#define N_BREAKPOINTS (sizeof(breakpoints) / sizeof(breakpoints[0]))
+
+static int value(uint32_t x)
+{
+    int v = breakpoints[0].value;
+    for (size_t i = 0; i < N_BREAKPOINTS && breakpoints[i].x <= x; i++)
+        v = breakpoints[i].value;
+    return v;
+}
+
+int main(void)
+{
+    /* The table covers arguments below 1 << LOG2_ARG_BITS, the largest of
+     * them standing in for all that are larger. That only holds if the last
+     * step is below it.
+     */
+    const uint32_t max = (1 << LOG2_ARG_BITS) - 1;
+    if (breakpoints[N_BREAKPOINTS - 1].x >= max) {
+        fprintf(stderr, "gen-log2-table: last step out of range\n");
+        return EXIT_FAILURE;
+    }
+
+    const int n_shifts = LOG2_ARG_BITS - LOG2_MANTISSA_BITS;
+    const int size = (n_shifts + 1) << LOG2_MANTISSA_BITS;
+
+    printf("/* Generated by scripts/gen-log2-table.c, do not edit */\n\n");
+    printf("#define LOG2_MANTISSA_BITS %d\n", LOG2_MANTISSA_BITS);
+    printf("#define LOG2_TABLE_SIZE %d\n\n", size);
+    printf("static const struct log2_entry log2_table[LOG2_TABLE_SIZE] = {\n");
+
+    for (int i = 0; i < size; i++) {
+        /* The inverse of the indexing in log2_lshift16() */
+        int shift = i >> LOG2_MANTISSA_BITS;
+        if (shift)
+            shift--;
+        uint32_t lo = (uint32_t) (i - (shift << LOG2_MANTISSA_BITS)) << shift;
+        uint32_t hi = lo + (1 << shift) - 1;
+        int base = value(lo), step = lo;
+
+        if (value(hi) == base) {
+            /* Nothing changes in the bucket, so the comparison always holds */
+            base--;
+        } else {
+            while (value(step) == base)
+                step++;
+            if (value(step) != base + 1 || value(hi) != base + 1) {
+                fprintf(stderr, "gen-log2-table: %u..%u needs more bits\n", lo,
+                        hi);
+                return EXIT_FAILURE;
+            }
+        }
+        printf("    {%d, %d},\n", base, step);
+    }
+
+    printf("};\n");
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -8,6 +9,44 @@
 /* Shannon full integer entropy calculation */
 #define BUCKET_SIZE (1 << 8)
 
+/* Bytes are counted into this many histograms in turn, so that a run of the
+ * same byte does not serialize on incrementing a single counter.
+ */
+#define N_HISTOGRAMS 4
+
+/* Strings up to this length have the term of every possible count memoized */
+#define TERM_MAX_LEN 64
+
+/* Every histogram is zero between calls; only the buckets of bytes that occur
+ * in a string are cleared afterwards, instead of all of them.
+ */
+static uint32_t histogram[N_HISTOGRAMS][BUCKET_SIZE];
+
+/* term[len][c] is the contribution of a byte occurring c times in a string of
+ * len bytes, filled in the first time a string of that length comes along.
+ */
+static uint64_t term[TERM_MAX_LEN + 1][TERM_MAX_LEN + 1];
+static uint8_t term_ready[TERM_MAX_LEN + 1];
+
+static inline uint64_t entropy_term(uint64_t c, uint64_t count)
+{
+    uint64_t p = c;
+    p *= LOG2_ARG_SHIFT / count;
+    return -p * log2_lshift16(p);
+}
+
+static const uint64_t *term_row(uint64_t count)
+{
+    if (count > TERM_MAX_LEN)
+        return NULL;
+    if (!term_ready[count]) {
+        for (uint64_t c = 1; c <= count; c++)
+            term[count][c] = entropy_term(c, count);
+        term_ready[count] = 1;
+    }
+    return term[count];
+}
+
 double shannon_entropy(const uint8_t *s)
 {
     assert(s);
@@ -15,18 +54,22 @@ double shannon_entropy(const uint8_t *s)
     uint64_t entropy_sum = 0;
     const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
 
-    uint32_t bucket[256];
-    memset(&bucket, 0, sizeof(bucket));
-
-    for (uint32_t i = 0; i < count; i++)
-        bucket[s[i]]++;
+    for (uint64_t i = 0; i < count; i++)
+        histogram[i % N_HISTOGRAMS][s[i]]++;
 
-    for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
-        if (bucket[i]) {
-            uint64_t p = bucket[i];
-            p *= LOG2_ARG_SHIFT / count;
-            entropy_sum += -p * log2_lshift16(p);
+    /* Visit the bucket of each distinct byte once, in order of appearance.
+     * The sum wraps around like the unsigned arithmetic of a scan over all
+     * buckets, so the order does not change the result.
+     */
+    const uint64_t *row = term_row(count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t c = 0;
+        for (int h = 0; h < N_HISTOGRAMS; h++) {
+            c += histogram[h][s[i]];
+            histogram[h][s[i]] = 0;
         }
+        if (c)
+            entropy_sum += row ? row[c] : entropy_term(c, count);
     }
 
     entropy_sum /= LOG2_ARG_SHIFT;
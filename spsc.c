@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+spsc_t *spsc_new(size_t capacity)
+{
+    if (!capacity || capacity > (SIZE_MAX >> 1) / sizeof(element_t *))
+        return NULL;
+
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    spsc_t *q = malloc(sizeof(spsc_t));
+    if (!q)
+        return NULL;
+    q->slots = malloc(size * sizeof(element_t *));
+    if (!q->slots) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->tail_cache = 0;
+    q->head_cache = 0;
+    q->mask = size - 1;
+    return q;
+}
+
+void spsc_free(spsc_t *q)
+{
+    if (!q)
+        return;
+    element_t *e;
+    while ((e = spsc_remove_head(q, NULL, 0)))
+        spsc_release_element(e);
+    free(q->slots);
+    free(q);
+}
+
+bool spsc_full(spsc_t *q)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - q->head_cache > q->mask) {
+        /* Pairs with the release of the head by the consumer, after which
+         * the slot it vacated may be reused
+         */
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        return tail - q->head_cache > q->mask;
+    }
+    return false;
+}
+
+bool spsc_empty(spsc_t *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == q->tail_cache) {
+        /* Pairs with the release of the tail by the producer, which makes
+         * the element in the slot visible
+         */
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        return head == q->tail_cache;
+    }
+    return false;
+}
+
+bool spsc_insert_tail(spsc_t *q, const char *s)
+{
+    if (spsc_full(q))
+        return false;
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    element_t *e = malloc(sizeof(element_t));
+    if (!e)
+        return false;
+    e->value = strdup(s);
+    if (!e->value) {
+        free(e);
+        return false;
+    }
+
+    q->slots[tail & q->mask] = e;
+    /* Publish the element along with the string it points to */
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+element_t *spsc_remove_head(spsc_t *q, char *sp, size_t bufsize)
+{
+    if (spsc_empty(q))
+        return NULL;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    element_t *e = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    if (sp) {
+        strncpy(sp, e->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    return e;
+}
+
+void spsc_release_element(element_t *e)
+{
+    free(e->value);
+    free(e);
+}
@@ -0,0 +1,100 @@
+#ifndef LAB0_SPSC_H
+#define LAB0_SPSC_H
+
+/* Bounded single-producer, single-consumer queue of element_t.
+ *
+ * One thread inserts at the tail while another removes from the head,
+ * without locks. The queue is a ring of element pointers indexed by two
+ * counters that only ever grow: the producer alone advances the tail and
+ * the consumer alone advances the head. Each side keeps a copy of the other
+ * side's counter and only reloads it when the ring looks full or empty, so
+ * that the cache line of the other side is not pulled in on every call.
+ *
+ * Elements are allocated through the harness like those of queue.h, which
+ * keeps track of them whichever thread frees them.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+/* Keeps the fields written by each thread on a cache line of their own */
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+    /* Written by the consumer */
+    atomic_size_t head;
+    size_t tail_cache; /* Tail last seen by the consumer */
+    char pad_head[SPSC_CACHE_LINE - sizeof(atomic_size_t) - sizeof(size_t)];
+
+    /* Written by the producer */
+    atomic_size_t tail;
+    size_t head_cache; /* Head last seen by the producer */
+    char pad_tail[SPSC_CACHE_LINE - sizeof(atomic_size_t) - sizeof(size_t)];
+
+    size_t mask; /* Capacity - 1, the capacity being a power of 2 */
+    element_t **slots;
+} spsc_t;
+
+/**
+ * spsc_new() - Create an empty queue
+ * @capacity: number of elements the queue holds at least
+ *
+ * Return: NULL for allocation failed or capacity is 0
+ */
+spsc_t *spsc_new(size_t capacity);
+
+/**
+ * spsc_free() - Free the queue along with the elements left in it, no effect
+ * if q is NULL. Neither thread may use the queue any more.
+ * @q: queue to free
+ */
+void spsc_free(spsc_t *q);
+
+/**
+ * spsc_insert_tail() - Insert an element at the tail, from the producer
+ * @q: queue
+ * @s: string would be inserted, which is copied
+ *
+ * Return: true for success, false for the queue being full or allocation
+ * failed
+ */
+bool spsc_insert_tail(spsc_t *q, const char *s);
+
+/**
+ * spsc_full() - Tell whether the queue is full, from the producer
+ * @q: queue
+ *
+ * Return: true if spsc_insert_tail() would fail for lack of room
+ */
+bool spsc_full(spsc_t *q);
+
+/**
+ * spsc_empty() - Tell whether the queue is empty, from the consumer
+ * @q: queue
+ *
+ * Return: true if spsc_remove_head() would find no element
+ */
+bool spsc_empty(spsc_t *q);
+
+/**
+ * spsc_remove_head() - Remove the element at the head, from the consumer
+ * @q: queue
+ * @sp: string would be copied, as with q_remove_head()
+ * @bufsize: size of the string
+ *
+ * Return: the removed element, to be released with spsc_release_element(),
+ * or NULL if the queue is empty
+ */
+element_t *spsc_remove_head(spsc_t *q, char *sp, size_t bufsize);
+
+/**
+ * spsc_release_element() - Release the storage of an element removed from
+ * the queue, in any thread
+ * @e: element to release
+ */
+void spsc_release_element(element_t *e);
+
+#endif /* LAB0_SPSC_H */
@@ -0,0 +1,432 @@
+/* Compiler and loader for binary command traces */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Growable byte buffer used while encoding */
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} bytes_t;
+
+static bool bytes_reserve(bytes_t *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return true;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n)
+        cap <<= 1;
+    uint8_t *data = realloc(b->data, cap);
+    if (!data)
+        return false;
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static bool put_bytes(bytes_t *b, const void *p, size_t n)
+{
+    if (!bytes_reserve(b, n))
+        return false;
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return true;
+}
+
+/* Unsigned LEB128: 7 bits per byte, high bit set on all but the last byte */
+static bool put_varint(bytes_t *b, uint64_t v)
+{
+    if (!bytes_reserve(b, 10))
+        return false;
+    do {
+        uint8_t byte = v & 0x7f;
+        v >>= 7;
+        if (v)
+            byte |= 0x80;
+        b->data[b->len++] = byte;
+    } while (v);
+    return true;
+}
+
+static bool get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *v)
+{
+    const uint8_t *p = *pp;
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p >= end)
+            return false;
+        uint8_t byte = *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *pp = p;
+            *v = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* String interning with open addressing.
+ * Slots hold (index + 1) into strs, so that zero marks an empty slot.
+ */
+typedef struct {
+    char **strs;
+    size_t n_strs, cap_strs;
+    uint32_t *slots;
+    size_t n_slots;
+} intern_t;
+
+static uint32_t hash_str(const char *s)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool intern_grow(intern_t *t)
+{
+    size_t n_slots = t->n_slots ? t->n_slots << 1 : 256;
+    uint32_t *slots = calloc(n_slots, sizeof(uint32_t));
+    if (!slots)
+        return false;
+
+    for (size_t i = 0; i < t->n_strs; i++) {
+        size_t pos = hash_str(t->strs[i]) & (n_slots - 1);
+        while (slots[pos])
+            pos = (pos + 1) & (n_slots - 1);
+        slots[pos] = i + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->n_slots = n_slots;
+    return true;
+}
+
+static bool intern(intern_t *t, const char *s, uint32_t *id)
+{
+    /* Keep load factor below one half */
+    if (2 * (t->n_strs + 1) > t->n_slots && !intern_grow(t))
+        return false;
+
+    size_t pos = hash_str(s) & (t->n_slots - 1);
+    while (t->slots[pos]) {
+        uint32_t idx = t->slots[pos] - 1;
+        if (!strcmp(t->strs[idx], s)) {
+            *id = idx;
+            return true;
+        }
+        pos = (pos + 1) & (t->n_slots - 1);
+    }
+
+    if (t->n_strs == t->cap_strs) {
+        size_t cap = t->cap_strs ? t->cap_strs << 1 : 64;
+        char **strs = realloc(t->strs, cap * sizeof(char *));
+        if (!strs)
+            return false;
+        t->strs = strs;
+        t->cap_strs = cap;
+    }
+    char *copy = strdup(s);
+    if (!copy)
+        return false;
+
+    *id = t->n_strs;
+    t->strs[t->n_strs++] = copy;
+    t->slots[pos] = *id + 1;
+    return true;
+}
+
+static void intern_free(intern_t *t)
+{
+    for (size_t i = 0; i < t->n_strs; i++)
+        free(t->strs[i]);
+    free(t->strs);
+    free(t->slots);
+}
+
+/* Split line in place using the same rules as the console parser */
+static int split_line(char *line, char ***argvp, size_t *capp)
+{
+    int argc = 0;
+    char *p = line;
+    while (*p) {
+        while (*p && isspace((unsigned char) *p))
+            *p++ = '\0';
+        if (!*p)
+            break;
+        if ((size_t) argc == *capp) {
+            size_t cap = *capp ? *capp << 1 : 16;
+            char **argv = realloc(*argvp, cap * sizeof(char *));
+            if (!argv)
+                return -1;
+            *argvp = argv;
+            *capp = cap;
+        }
+        (*argvp)[argc++] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+    }
+    return argc;
+}
+
+static bool put_record(bytes_t *b, uint32_t repeat, int argc, uint32_t *ids)
+{
+    bool ok = put_varint(b, repeat) && put_varint(b, argc);
+    for (int i = 0; ok && i < argc; i++)
+        ok = put_varint(b, ids[i]);
+    return ok;
+}
+
+bool trace_compile(const char *src, const char *dst)
+{
+    FILE *in = fopen(src, "r");
+    if (!in)
+        return false;
+
+    intern_t table = {0};
+    bytes_t records = {0}, out = {0};
+    char *line = NULL, **argv = NULL;
+    size_t line_cap = 0, argv_cap = 0;
+    uint32_t *ids = NULL, *prev_ids = NULL;
+    size_t ids_cap = 0;
+    int prev_argc = -1;
+    uint32_t repeat = 0;
+    uint64_t n_records = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &line_cap, in) != -1) {
+        int argc = split_line(line, &argv, &argv_cap);
+        if (argc < 0) {
+            ok = false;
+            break;
+        }
+        if (argc == 0)
+            continue;
+
+        if ((size_t) argc > ids_cap) {
+            uint32_t *tmp = realloc(ids, argc * sizeof(uint32_t));
+            if (!tmp) {
+                ok = false;
+                break;
+            }
+            ids = tmp;
+            tmp = realloc(prev_ids, argc * sizeof(uint32_t));
+            if (!tmp) {
+                ok = false;
+                break;
+            }
+            prev_ids = tmp;
+            ids_cap = argc;
+        }
+        for (int i = 0; ok && i < argc; i++)
+            ok = intern(&table, argv[i], &ids[i]);
+        if (!ok)
+            break;
+
+        /* Fold consecutive identical lines into one record */
+        if (argc == prev_argc && repeat < UINT32_MAX &&
+            !memcmp(ids, prev_ids, argc * sizeof(uint32_t))) {
+            repeat++;
+            continue;
+        }
+        if (prev_argc > 0) {
+            ok = put_record(&records, repeat, prev_argc, prev_ids);
+            n_records++;
+        }
+        uint32_t *swap = prev_ids;
+        prev_ids = ids;
+        ids = swap;
+        prev_argc = argc;
+        repeat = 1;
+    }
+    if (ok && prev_argc > 0) {
+        ok = put_record(&records, repeat, prev_argc, prev_ids);
+        n_records++;
+    }
+    fclose(in);
+
+    ok = ok && put_bytes(&out, TRACE_MAGIC, 4) &&
+         put_varint(&out, TRACE_VERSION) && put_varint(&out, table.n_strs);
+    for (size_t i = 0; ok && i < table.n_strs; i++) {
+        size_t len = strlen(table.strs[i]);
+        ok = put_varint(&out, len) && put_bytes(&out, table.strs[i], len);
+    }
+    ok = ok && put_varint(&out, n_records) &&
+         put_bytes(&out, records.data, records.len);
+
+    if (ok) {
+        FILE *fout = fopen(dst, "wb");
+        ok = fout && fwrite(out.data, 1, out.len, fout) == out.len;
+        if (fout && fclose(fout))
+            ok = false;
+    }
+
+    free(line);
+    free(argv);
+    free(ids);
+    free(prev_ids);
+    free(records.data);
+    free(out.data);
+    intern_free(&table);
+    return ok;
+}
+
+static uint8_t *read_file(const char *file_name, size_t *sizep)
+{
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    uint8_t *data = malloc(size);
+    size_t offset = 0;
+    while (data && offset < size) {
+        ssize_t n = read(fd, data + offset, size - offset);
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        offset += n;
+    }
+    close(fd);
+    *sizep = size;
+    return data;
+}
+
+/* Decode records. With trace->id_pool == NULL, only count and validate. */
+static bool decode_records(trace_t *trace,
+                           const uint8_t *p,
+                           const uint8_t *end)
+{
+    size_t n_args = 0;
+    for (size_t i = 0; i < trace->n_records; i++) {
+        uint64_t repeat, argc;
+        if (!get_varint(&p, end, &repeat) || !get_varint(&p, end, &argc) ||
+            repeat == 0 || repeat > UINT32_MAX || argc == 0 ||
+            argc > (uint64_t) (end - p))
+            return false;
+
+        trace_record_t *rec = &trace->records[i];
+        if (trace->id_pool) {
+            rec->repeat = repeat;
+            rec->argc = argc;
+            rec->ids = trace->id_pool + n_args;
+            rec->argv = trace->argv_pool + n_args;
+        }
+        for (uint64_t j = 0; j < argc; j++) {
+            uint64_t id;
+            if (!get_varint(&p, end, &id) || id >= trace->n_strs)
+                return false;
+            if (trace->id_pool) {
+                rec->ids[j] = id;
+                rec->argv[j] = trace->strs[id];
+            }
+        }
+        n_args += argc;
+    }
+    trace->n_args = n_args;
+    return p == end;
+}
+
+trace_t *trace_load(const char *file_name)
+{
+    size_t size = 0;
+    uint8_t *data = read_file(file_name, &size);
+    if (!data)
+        return NULL;
+
+    const uint8_t *p = data, *end = data + size;
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    uint64_t version, n_strs, n_records;
+    bool ok = trace && size > 4 && !memcmp(p, TRACE_MAGIC, 4);
+    if (ok) {
+        p += 4;
+        ok = get_varint(&p, end, &version) && version == TRACE_VERSION &&
+             get_varint(&p, end, &n_strs) && n_strs <= (uint64_t) (end - p);
+    }
+
+    /* First pass over the string table to size the pool */
+    const uint8_t *strs_start = p;
+    size_t pool_size = 0;
+    for (uint64_t i = 0; ok && i < n_strs; i++) {
+        uint64_t len;
+        ok = get_varint(&p, end, &len) && len <= (uint64_t) (end - p);
+        if (ok) {
+            p += len;
+            pool_size += len + 1;
+        }
+    }
+    ok = ok && get_varint(&p, end, &n_records) &&
+         n_records <= (uint64_t) (end - p);
+
+    if (ok) {
+        trace->n_strs = n_strs;
+        trace->n_records = n_records;
+        trace->str_pool = malloc(pool_size ? pool_size : 1);
+        trace->strs = calloc(n_strs ? n_strs : 1, sizeof(char *));
+        trace->records =
+            calloc(n_records ? n_records : 1, sizeof(trace_record_t));
+        ok = trace->str_pool && trace->strs && trace->records;
+    }
+
+    if (ok) {
+        const uint8_t *q = strs_start;
+        char *dst = trace->str_pool;
+        for (size_t i = 0; i < trace->n_strs; i++) {
+            uint64_t len;
+            get_varint(&q, end, &len);
+            memcpy(dst, q, len);
+            dst[len] = '\0';
+            trace->strs[i] = dst;
+            dst += len + 1;
+            q += len;
+        }
+
+        ok = decode_records(trace, p, end);
+        if (ok) {
+            size_t n_args = trace->n_args ? trace->n_args : 1;
+            trace->id_pool = calloc(n_args, sizeof(uint32_t));
+            trace->argv_pool = calloc(n_args, sizeof(char *));
+            ok = trace->id_pool && trace->argv_pool &&
+                 decode_records(trace, p, end);
+        }
+    }
+
+    free(data);
+    if (!ok) {
+        trace_free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void trace_free(trace_t *trace)
+{
+    if (!trace)
+        return;
+    free(trace->str_pool);
+    free(trace->strs);
+    free(trace->records);
+    free(trace->id_pool);
+    free(trace->argv_pool);
+    free(trace);
+}
@@ -0,0 +1,57 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compact binary representation of command traces.
+ *
+ * A compiled trace consists of a header, a table of interned strings and a
+ * sequence of records. Every record refers to its command name and arguments
+ * by string index, and runs of identical lines are folded into a single
+ * record with a repeat count. All integers are stored as unsigned LEB128
+ * varints.
+ *
+ *   "QTRC" version
+ *   n_strs  { len bytes } * n_strs
+ *   n_recs  { repeat argc { str_id } * argc } * n_recs
+ */
+
+#define TRACE_MAGIC "QTRC"
+#define TRACE_VERSION 1
+
+/* One (possibly repeated) command line */
+typedef struct {
+    uint32_t repeat;
+    int argc;
+    uint32_t *ids; /* Index of each argument in string table */
+    char **argv;   /* Resolved arguments, pointing into string table */
+} trace_record_t;
+
+/* Trace loaded in memory, ready for replay */
+typedef struct {
+    size_t n_strs;
+    char **strs;
+    size_t n_records;
+    trace_record_t *records;
+
+    /* Backing storage for the pointers above */
+    char *str_pool;
+    uint32_t *id_pool;
+    char **argv_pool;
+    size_t n_args;
+} trace_t;
+
+/* Convert text command file src into binary trace dst.
+ * Return true if successful.
+ */
+bool trace_compile(const char *src, const char *dst);
+
+/* Load binary trace file. Return NULL if it cannot be read or is malformed */
+trace_t *trace_load(const char *file_name);
+
+/* Release trace returned by trace_load */
+void trace_free(trace_t *trace);
+
+#endif /* LAB0_TRACE_H */
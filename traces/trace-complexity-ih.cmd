@@ -0,0 +1,5 @@
+# Estimated complexity of q_insert_head, which must come out as O(1)
+new
+complexity ih
+free
+quit
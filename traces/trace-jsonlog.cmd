@@ -0,0 +1,10 @@
+# Log every command below as a line of JSON, which make check parses
+jsonlog /tmp/qtest.jsonl
+new
+ih dolphin
+it "quoted\\path"
+ih café
+repeat 2 rt
+size
+free
+quit
@@ -0,0 +1,15 @@
+# repeat must run its command exactly the number of times given
+new
+it a
+it b
+it c
+it d
+it e
+it f
+repeat 5 rh
+# Only f is left
+size
+rh f
+size
+free
+quit
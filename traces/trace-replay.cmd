@@ -0,0 +1,2 @@
+# Compile the example trace into the binary trace 'make check' replays with -b
+compile traces/trace-eg.cmd /tmp/qtest.replay.bin
@@ -3,124 +3,272 @@
  */
 
 #include <arpa/inet.h> /* inet_ntoa */
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
 
+/* Largest request header block accepted from a client */
+#define REQ_BUFSIZE 8192
+
+/* Largest script accepted in the body of a POST request */
+#define MAX_SCRIPT (16 * 1024 * 1024)
+
+/* Requests below this path fetch files instead of running commands */
+#define FILE_PREFIX "file/"
+
+/* Request for server counters */
+#define METRICS_PATH "metrics"
+
+/* Maximum number of events handled per wait */
+#define MAX_EVENTS 64
+
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define TCP_CORK TCP_NOPUSH
-#endif
-
 static int server_fd;
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
-
 typedef struct {
     char filename[512];
     off_t offset; /* for support Range */
     size_t end;
+    bool range;
+    bool keep_alive;
+    bool post;             /* body holds a script of commands */
+    size_t content_length; /* size of body */
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
+/* File contents to be sent once the output buffer reaches mark */
+typedef struct __web_file {
+    int fd;
+    off_t offset;
+    size_t remain;
+    size_t mark;
+    struct __web_file *next;
+} web_file_t;
+
+/* Per-connection state. Requests may arrive in pieces, and several requests
+ * may arrive back to back on the same keep-alive connection.
+ */
+typedef struct __web_conn {
+    int fd;
+    char *in; /* received bytes not yet parsed, null-terminated */
+    size_t in_len, in_cap;
+    size_t scan;     /* start of first header line not yet examined */
+    size_t head_len; /* length of complete header awaiting its body */
+    char *out; /* response bytes not yet written */
+    size_t out_len, out_off, out_cap;
+    web_file_t *files, *files_tail; /* file transfers, in order */
+    int pending;       /* queued commands not yet answered */
+    bool peer_closed;  /* no more requests will arrive */
+    bool close_after;  /* close once output is drained */
+    bool want_read, want_write; /* registered interest */
+    struct __web_conn *next;
+} web_conn_t;
+
+static web_conn_t *conns = NULL;
+
+/* Commands received from all clients, in order of arrival */
+typedef struct __web_cmd {
+    web_conn_t *conn;
+    char line[MAXLINE];
+    bool keep_alive;
+    /* Commands of a POST script share one chunked response */
+    bool batch, batch_first, batch_last;
+    /* Requests other than commands are answered by the server itself */
+    enum { REQ_CMD, REQ_FILE, REQ_METRICS } kind;
+    off_t offset;
+    size_t end;
+    bool range;
+    struct __web_cmd *next;
+} web_cmd_t;
+
+static web_cmd_t *cmd_head = NULL, *cmd_tail = NULL;
+
+/* Command currently executed by the console, and the output it produced */
+static web_cmd_t *active_cmd = NULL;
+static struct timespec active_start;
+
+/* Growable text buffer */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} buf_t;
+
+static buf_t reply;   /* output of the active command */
+static buf_t metrics; /* body of the latest /metrics response */
+
+/* Functions contributing to /metrics */
+#define MAX_METRICS_FN 8
+static web_metrics_fn metrics_fns[MAX_METRICS_FN];
+static int n_metrics_fns = 0;
+
+/* Tags distinguishing the two special descriptors from connections */
+static int stdin_tag, listen_tag;
+
+typedef struct {
+    void *tag;
+    bool readable, writable;
+} mux_event_t;
+
+/* Readiness notification. epoll is used on Linux, so that the cost of each
+ * wait does not grow with the number of idle keep-alive connections. Other
+ * systems fall back to poll.
+ */
+#if defined(__linux__)
+static int mux_fd = -1;
+
+static bool mux_init(void)
 {
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
+    if (mux_fd < 0)
+        mux_fd = epoll_create1(EPOLL_CLOEXEC);
+    return mux_fd >= 0;
 }
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
+static int mux_ctl(int op, int fd, void *tag, bool want_read, bool want_write)
+{
+    struct epoll_event ev = {
+        .events = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0),
+        .data.ptr = tag,
+    };
+    return epoll_ctl(mux_fd, op, fd, &ev);
+}
+
+static int mux_add(int fd, void *tag)
+{
+    return mux_ctl(EPOLL_CTL_ADD, fd, tag, true, false);
+}
+
+static int mux_mod(int fd, void *tag, bool want_read, bool want_write)
+{
+    return mux_ctl(EPOLL_CTL_MOD, fd, tag, want_read, want_write);
+}
+
+static void mux_del(int fd)
+{
+    epoll_ctl(mux_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int mux_wait(mux_event_t *events, int max_events)
+{
+    struct epoll_event evs[MAX_EVENTS];
+    if (max_events > MAX_EVENTS)
+        max_events = MAX_EVENTS;
+    int n = epoll_wait(mux_fd, evs, max_events, -1);
+    for (int i = 0; i < n; i++) {
+        events[i].tag = evs[i].data.ptr;
+        events[i].readable = evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+        events[i].writable = evs[i].events & EPOLLOUT;
     }
+    return n;
+}
+#else
+typedef struct {
+    int fd;
+    void *tag;
+    bool want_read, want_write;
+} mux_entry_t;
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
+static mux_entry_t *mux_entries = NULL;
+static int mux_count = 0, mux_cap = 0;
+
+static bool mux_init(void)
+{
+    return true;
 }
 
-static ssize_t writen(int fd, void *usrbuf, size_t n)
+static int mux_add(int fd, void *tag)
 {
-    size_t nleft = n;
-    char *bufp = usrbuf;
+    if (mux_count == mux_cap) {
+        int cap = mux_cap ? mux_cap * 2 : 16;
+        mux_entry_t *entries = realloc(mux_entries, cap * sizeof(mux_entry_t));
+        if (!entries)
+            return -1;
+        mux_entries = entries;
+        mux_cap = cap;
+    }
+    mux_entries[mux_count++] = (mux_entry_t){fd, tag, true, false};
+    return 0;
+}
 
-    while (nleft > 0) {
-        ssize_t nwritten = write(fd, bufp, nleft);
-        if (nwritten <= 0) {
-            if (errno == EINTR) { /* interrupted by sig handler return */
-                nwritten = 0;     /* and call write() again */
-            } else
-                return -1; /* errorno set by write() */
+static int mux_mod(int fd, void *tag, bool want_read, bool want_write)
+{
+    for (int i = 0; i < mux_count; i++) {
+        if (mux_entries[i].fd == fd) {
+            mux_entries[i].tag = tag;
+            mux_entries[i].want_read = want_read;
+            mux_entries[i].want_write = want_write;
+            return 0;
         }
-        nleft -= nwritten;
-        bufp += nwritten;
     }
-    return n;
+    return -1;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static void mux_del(int fd)
 {
-    char c, *bufp = usrbuf;
+    for (int i = 0; i < mux_count; i++) {
+        if (mux_entries[i].fd == fd) {
+            mux_entries[i] = mux_entries[--mux_count];
+            return;
+        }
+    }
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
+static int mux_wait(mux_event_t *events, int max_events)
+{
+    struct pollfd *pfds = calloc(mux_count, sizeof(struct pollfd));
+    if (!pfds)
+        return -1;
+    for (int i = 0; i < mux_count; i++) {
+        pfds[i].fd = mux_entries[i].fd;
+        pfds[i].events = (mux_entries[i].want_read ? POLLIN : 0) |
+                         (mux_entries[i].want_write ? POLLOUT : 0);
+    }
+
+    int n = poll(pfds, mux_count, -1);
+    int cnt = 0;
+    for (int i = 0; n > 0 && i < mux_count && cnt < max_events; i++) {
+        if (!pfds[i].revents)
+            continue;
+        events[cnt].tag = mux_entries[i].tag;
+        events[cnt].readable = pfds[i].revents & (POLLIN | POLLHUP | POLLERR);
+        events[cnt].writable = pfds[i].revents & POLLOUT;
+        cnt++;
+    }
+    free(pfds);
+    return n < 0 ? n : cnt;
 }
+#endif
 
-void web_send(int out_fd, char *buf)
+static int set_nonblocking(int fd)
 {
-    writen(out_fd, buf, strlen(buf));
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 int web_open(int port)
@@ -137,12 +285,6 @@ int web_open(int port)
                    sizeof(int)) < 0)
         return -1;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
-
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -156,6 +298,14 @@ int web_open(int port)
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
 
+    /* Accept every pending connection per readiness notification */
+    if (set_nonblocking(listenfd) < 0)
+        return -1;
+
+    if (!mux_init() || mux_add(STDIN_FILENO, &stdin_tag) < 0 ||
+        mux_add(listenfd, &listen_tag) < 0)
+        return -1;
+
     server_fd = listenfd;
 
     return listenfd;
@@ -177,94 +327,876 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* Return next space-separated token of the request line */
+static const char *next_token(const char **pp, const char *end, size_t *lenp)
+{
+    const char *p = *pp;
+    while (p < end && *p == ' ')
+        p++;
+    const char *token = p;
+    while (p < end && *p != ' ' && *p != '\r')
+        p++;
+    *lenp = p - token;
+    *pp = p;
+    return token;
+}
+
+static bool header_is(const char *name, size_t len, const char *expected)
+{
+    return len == strlen(expected) && !strncasecmp(name, expected, len);
+}
+
+/* Range: bytes=start-[end], where end is inclusive */
+static void parse_range(const char *value, const char *end, http_request_t *req)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    if (end - value < 7 || strncasecmp(value, "bytes=", 6) ||
+        !isdigit((unsigned char) value[6]))
+        return;
+
+    char *p;
+    req->offset = strtoul(value + 6, &p, 10);
+    if (*p != '-')
+        return;
+    req->range = true;
+    if (isdigit((unsigned char) p[1]))
+        req->end = strtoul(p + 1, NULL, 10) + 1;
+}
+
+/* Parse a complete header block of len bytes. The block is scanned line by
+ * line with memchr, and header names are matched without regard to case.
+ */
+static void parse_request(const char *block, size_t len, http_request_t *req)
+{
+    const char *end = block + len;
     req->offset = 0;
     req->end = 0; /* default */
+    req->range = false;
+    req->content_length = 0;
+
+    /* Request line: method uri version */
+    const char *eol = memchr(block, '\n', len);
+    const char *p = block;
+    size_t method_len, uri_len, version_len;
+    const char *method = next_token(&p, eol, &method_len);
+    const char *uri = next_token(&p, eol, &uri_len);
+    const char *version = next_token(&p, eol, &version_len);
+    req->post = header_is(method, method_len, "POST");
+    /* HTTP/1.1 connections are persistent unless told otherwise */
+    req->keep_alive =
+        version_len && !header_is(version, version_len, "HTTP/1.0");
+
+    for (const char *line = eol + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        const char *colon = memchr(line, ':', eol - line);
+        if (!colon)
+            continue;
+
+        const char *value = colon + 1, *value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (value_end > value &&
+               (value_end[-1] == '\r' || value_end[-1] == ' ' ||
+                value_end[-1] == '\t'))
+            value_end--;
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+        size_t name_len = colon - line;
+        if (header_is(line, name_len, "Range")) {
+            parse_range(value, value_end, req);
+        } else if (header_is(line, name_len, "Connection")) {
+            size_t value_len = value_end - value;
+            if (value_len >= 5 && !strncasecmp(value, "close", 5))
+                req->keep_alive = false;
+            else if (value_len >= 10 && !strncasecmp(value, "keep-alive", 10))
+                req->keep_alive = true;
+        } else if (header_is(line, name_len, "Content-Length")) {
+            if (value < value_end && isdigit((unsigned char) *value))
+                req->content_length = strtoul(value, NULL, 10);
         }
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
+
+    /* Strip leading '/' and query string */
+    if (uri_len && *uri == '/') {
+        uri++;
+        uri_len--;
+    }
+    const char *query = memchr(uri, '?', uri_len);
+    if (query)
+        uri_len = query - uri;
+
+    char path[MAXLINE] = ".";
+    if (uri_len)
+        snprintf(path, sizeof(path), "%.*s", (int) uri_len, uri);
+    url_decode(path, req->filename, sizeof(req->filename));
+}
+
+static bool conn_append(web_conn_t *conn, const char *data, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : BUFSIZE;
+        while (cap < conn->out_len + len)
+            cap <<= 1;
+        char *out = realloc(conn->out, cap);
+        if (!out)
+            return false;
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return true;
+}
+
+static void conn_drop_files(web_conn_t *conn)
+{
+    while (conn->files) {
+        web_file_t *file = conn->files;
+        conn->files = file->next;
+        close(file->fd);
+        free(file);
+    }
+    conn->files_tail = NULL;
+}
+
+static void conn_close(web_conn_t *conn)
+{
+    mux_del(conn->fd);
+    close(conn->fd);
+
+    web_conn_t **p = &conns;
+    while (*p != conn)
+        p = &(*p)->next;
+    *p = conn->next;
+
+    conn_drop_files(conn);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+/* Send file contents directly from the page cache where possible */
+static ssize_t send_file(int out_fd, web_file_t *file)
+{
+#if defined(__linux__)
+    return sendfile(out_fd, file->fd, &file->offset, file->remain);
+#else
+    char buf[BUFSIZE * 8];
+    size_t len = file->remain < sizeof(buf) ? file->remain : sizeof(buf);
+    ssize_t n = pread(file->fd, buf, len, file->offset);
+    if (n <= 0)
+        return n;
+    n = write(out_fd, buf, n);
+    if (n > 0)
+        file->offset += n;
+    return n;
+#endif
+}
+
+/* Write as much pending output as the socket accepts. Connections that are
+ * done are closed, so conn must not be used if this returns false.
+ */
+static bool conn_flush(web_conn_t *conn)
+{
+    for (;;) {
+        web_file_t *file = conn->files;
+        size_t limit = file ? file->mark : conn->out_len;
+        ssize_t n;
+        if (conn->out_off < limit) {
+            n = write(conn->fd, conn->out + conn->out_off,
+                      limit - conn->out_off);
+            if (n > 0)
+                conn->out_off += n;
+        } else if (file && file->remain) {
+            n = send_file(conn->fd, file);
+            if (n > 0)
+                file->remain -= n;
+            else if (n == 0)
+                errno = EIO; /* file shrank under us */
+        } else if (file) {
+            conn->files = file->next;
+            if (!conn->files)
+                conn->files_tail = NULL;
+            close(file->fd);
+            free(file);
+            continue;
         } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
+            break;
         }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            /* Peer is gone; drop output but keep answering queued commands */
+            conn_drop_files(conn);
+            conn->out_off = conn->out_len;
+            conn->peer_closed = true;
+            conn->close_after = true;
+        }
+    }
+
+    bool drained = conn->out_off == conn->out_len && !conn->files;
+    if (drained)
+        conn->out_off = conn->out_len = 0;
+
+    if (drained && !conn->pending && (conn->close_after || conn->peer_closed)) {
+        conn_close(conn);
+        return false;
     }
-    url_decode(filename, req->filename, MAXLINE);
+
+    /* Stop polling a closed peer for input, so that EOF does not spin */
+    bool want_read = !conn->peer_closed;
+    if (conn->want_read != want_read || conn->want_write == drained) {
+        conn->want_read = want_read;
+        conn->want_write = !drained;
+        mux_mod(conn->fd, conn, conn->want_read, conn->want_write);
+    }
+    return true;
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+static void serve_local(web_cmd_t *cmd);
+
+static web_cmd_t *new_cmd(web_conn_t *conn, const http_request_t *req)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    web_cmd_t *cmd = calloc(1, sizeof(web_cmd_t));
+    if (cmd) {
+        cmd->conn = conn;
+        cmd->keep_alive = req->keep_alive;
+    }
+    return cmd;
+}
+
+static void link_cmd(web_cmd_t *cmd)
+{
+    web_conn_t *conn = cmd->conn;
+    if (cmd_tail)
+        cmd_tail->next = cmd;
+    else
+        cmd_head = cmd;
+    cmd_tail = cmd;
+    conn->pending++;
+}
+
+static web_cmd_t *push_cmd(web_conn_t *conn, const http_request_t *req)
+{
+    web_cmd_t *cmd = new_cmd(conn, req);
+    if (cmd)
+        link_cmd(cmd);
+    return cmd;
+}
+
+static void enqueue_cmd(web_conn_t *conn, const http_request_t *req)
+{
+    web_cmd_t *cmd = new_cmd(conn, req);
+    if (!cmd)
+        return;
+
+    size_t len = strlen(FILE_PREFIX);
+    if (!strncmp(req->filename, FILE_PREFIX, len)) {
+        snprintf(cmd->line, sizeof(cmd->line), "%s", req->filename + len);
+        cmd->kind = REQ_FILE;
+        cmd->offset = req->offset;
+        cmd->end = req->end;
+        cmd->range = req->range;
+    } else if (!strcmp(req->filename, METRICS_PATH)) {
+        cmd->kind = REQ_METRICS;
+    }
+
+    if (cmd->kind != REQ_CMD) {
+        /* With no earlier response outstanding, answer without queueing,
+         * so that a busy console does not delay it.
+         */
+        if (!conn->pending)
+            serve_local(cmd);
+        else
+            link_cmd(cmd);
+        return;
+    }
+    link_cmd(cmd);
 
-    char *p = req.filename;
     /* Change '/' to ' ' */
+    snprintf(cmd->line, sizeof(cmd->line), "%s", req->filename);
+    char *p = cmd->line;
     while (*p) {
         ++p;
         if (*p == '/')
             *p = ' ';
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+}
+
+/* Queue every non-empty line of a POST body as a separate command */
+static void enqueue_script(web_conn_t *conn,
+                           const http_request_t *req,
+                           const char *script,
+                           size_t len)
+{
+    web_cmd_t *first = NULL, *last = NULL;
+    const char *p = script, *end = script + len;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        size_t n = eol - p;
+        if (n && p[n - 1] == '\r')
+            n--;
+        p = eol + 1;
+        if (!n)
+            continue;
 
-    return ret;
+        web_cmd_t *cmd = push_cmd(conn, req);
+        if (!cmd)
+            break;
+        snprintf(cmd->line, sizeof(cmd->line), "%.*s", (int) n, eol - n);
+        cmd->batch = true;
+        if (!first)
+            first = cmd;
+        last = cmd;
+    }
+
+    if (first) {
+        first->batch_first = true;
+        last->batch_last = true;
+        return;
+    }
+
+    /* Nothing to run, so answer right away */
+    char header[BUFSIZE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: %s\r\n\r\n",
+                     req->keep_alive ? "keep-alive" : "close");
+    if (!conn_append(conn, header, n) || !req->keep_alive)
+        conn->close_after = true;
 }
 
-int web_eventmux(char *buf)
+/* Return length of the header block in buf up to and including the empty
+ * line, or 0 if it is not complete yet. Bare LF line endings are accepted.
+ * Lines are located with memchr, and *scan carries the start of the first
+ * unfinished line over to the next call, so that each byte is examined once
+ * however the block is split across reads.
+ */
+static size_t find_header_end(const char *buf, size_t len, size_t *scan)
+{
+    size_t pos = *scan;
+    const char *eol;
+    while ((eol = memchr(buf + pos, '\n', len - pos))) {
+        size_t next = eol - buf + 1;
+        if (next - pos == 1 || (next - pos == 2 && buf[pos] == '\r')) {
+            *scan = 0;
+            return next;
+        }
+        pos = next;
+    }
+    *scan = pos;
+    return 0;
+}
+
+/* Queue every complete request received so far. Return false if the
+ * client sent something that cannot be served.
+ */
+static bool conn_parse(web_conn_t *conn)
 {
-    fd_set listenset;
+    size_t off = 0;
+    bool ok = true;
+    for (;;) {
+        char *start = conn->in + off;
+        size_t avail = conn->in_len - off;
+        size_t len = conn->head_len;
+        if (!len)
+            len = find_header_end(start, avail, &conn->scan);
+        if (!len) {
+            ok = avail < REQ_BUFSIZE;
+            break;
+        }
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+        /* Empty lines between requests are ignored */
+        if (len <= 2 && (*start == '\r' || *start == '\n')) {
+            off += len;
+            continue;
+        }
+
+        http_request_t req;
+        parse_request(start, len, &req);
+        if (req.post) {
+            if (req.content_length > MAX_SCRIPT) {
+                ok = false;
+                break;
+            }
+            /* Wait for the rest of the script */
+            if (avail - len < req.content_length) {
+                conn->head_len = len;
+                break;
+            }
+            conn->head_len = 0;
+            enqueue_script(conn, &req, start + len, req.content_length);
+            len += req.content_length;
+        } else {
+            enqueue_cmd(conn, &req);
+        }
+        off += len;
+
+        /* Requests pipelined behind one asking to close would never be
+         * answered, so they are not run either
+         */
+        if (!req.keep_alive) {
+            off = conn->in_len;
+            conn->scan = 0;
+            conn->peer_closed = true;
+            break;
+        }
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
+    /* Move the unparsed tail to the front once per read, not per request */
+    if (off) {
+        conn->in_len -= off;
+        memmove(conn->in, conn->in + off, conn->in_len + 1);
+    }
+    return ok;
+}
+
+/* Drain socket and queue every complete request received so far */
+static void conn_read(web_conn_t *conn)
+{
+    while (!conn->peer_closed) {
+        if (conn->in_len + 1 >= conn->in_cap) {
+            size_t cap = conn->in_cap ? conn->in_cap << 1 : REQ_BUFSIZE;
+            char *in = realloc(conn->in, cap);
+            if (!in) {
+                conn->peer_closed = true;
+                break;
+            }
+            conn->in = in;
+            conn->in_cap = cap;
+        }
+        ssize_t n = read(conn->fd, conn->in + conn->in_len,
+                         conn->in_cap - 1 - conn->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn->peer_closed = true;
+            break;
+        }
+        conn->in_len += n;
+        conn->in[conn->in_len] = '\0';
+
+        if (!conn_parse(conn)) {
+            /* Oversized request; stop reading from this client */
+            conn->peer_closed = true;
+            break;
+        }
+    }
+
+    conn_flush(conn);
+}
+
+static void accept_conns(void)
+{
+    for (;;) {
         struct sockaddr_in clientaddr;
         socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
-            accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+        int fd = accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (fd < 0)
+            return;
+
+        /* Responses are assembled before writing, so send them at once */
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &optval,
+                   sizeof(int));
 
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+        web_conn_t *conn = calloc(1, sizeof(web_conn_t));
+        if (!conn || set_nonblocking(fd) < 0 || mux_add(fd, conn) < 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->want_read = true;
+        conn->next = conns;
+        conns = conn;
     }
+}
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+static bool buf_reserve(buf_t *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return true;
+
+    size_t cap = b->cap ? b->cap : BUFSIZE;
+    while (cap < b->len + n)
+        cap <<= 1;
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return false;
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static void buf_vprintf(buf_t *b, const char *fmt, va_list ap)
+{
+    if (!buf_reserve(b, 1))
+        return;
+
+    va_list aq;
+    va_copy(aq, ap);
+    int len = vsnprintf(b->data + b->len, b->cap - b->len, fmt, aq);
+    va_end(aq);
+    if (len < 0)
+        return;
+    if (b->len + len >= b->cap) {
+        if (!buf_reserve(b, len + 1))
+            return;
+        vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+    }
+    b->len += len;
+}
+
+static void buf_printf(buf_t *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    buf_vprintf(b, fmt, ap);
+    va_end(ap);
+}
+
+static web_cmd_t *pop_cmd(void)
+{
+    web_cmd_t *cmd = cmd_head;
+    cmd_head = cmd->next;
+    if (!cmd_head)
+        cmd_tail = NULL;
+    return cmd;
+}
+
+/* Kinds of files served: traces, logs and results of runs */
+static const char *const file_types[] = {
+    ".cmd", ".bin", ".log", ".txt", ".json", ".jsonl", ".csv",
+};
+
+/* Only relative paths below the working directory are served, with no
+ * component starting with a dot, which keeps out ".." as well as .git and
+ * other hidden files, and only for the kinds of files above
+ */
+static bool path_allowed(const char *path)
+{
+    if (!*path || path[0] == '/')
+        return false;
+    for (const char *p = path; p; p = strchr(p, '/')) {
+        if (*p == '/')
+            p++;
+        if (p[0] == '.')
+            return false;
+    }
+
+    const char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/'))
+        return false;
+    for (size_t i = 0; i < sizeof(file_types) / sizeof(file_types[0]); i++) {
+        if (!strcmp(ext, file_types[i]))
+            return true;
+    }
+    return false;
+}
+
+/* Open path one component at a time, following no symbolic link on the
+ * way, so that a link cannot lead out of the working directory. Return the
+ * file descriptor, or -1 on failure.
+ */
+static int open_beneath(const char *path)
+{
+    char name[MAXLINE];
+    snprintf(name, sizeof(name), "%s", path);
+
+    int dir = AT_FDCWD;
+    char *save = NULL;
+    char *comp = strtok_r(name, "/", &save);
+    while (comp) {
+        char *next = strtok_r(NULL, "/", &save);
+        int flags = O_RDONLY | O_CLOEXEC | O_NOFOLLOW;
+        if (next)
+            flags |= O_DIRECTORY;
+        int fd = openat(dir, comp, flags);
+        if (dir != AT_FDCWD)
+            close(dir);
+        if (fd < 0 || !next)
+            return fd;
+        dir = fd;
+        comp = next;
+    }
+    if (dir != AT_FDCWD)
+        close(dir);
+    return -1;
+}
+
+/* Answer a file request. The header is buffered, while the contents are
+ * sent straight from the file once the output before them is written.
+ */
+static bool serve_file(web_conn_t *conn, const web_cmd_t *cmd)
+{
+    const char *status = "403 Forbidden";
+    char range[BUFSIZE] = "";
+    size_t start = 0, length = 0;
+    struct stat st;
+    int fd = -1;
+    if (path_allowed(cmd->line)) {
+        status = "404 Not Found";
+        fd = open_beneath(cmd->line);
+        if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        size_t size = st.st_size;
+        size_t end = cmd->end && cmd->end < size ? cmd->end : size;
+        if (!cmd->range) {
+            status = "200 OK";
+            length = size;
+        } else if ((size_t) cmd->offset < end) {
+            status = "206 Partial Content";
+            start = cmd->offset;
+            length = end - start;
+            snprintf(range, sizeof(range),
+                     "Content-Range: bytes %zu-%zu/%zu\r\n", start, end - 1,
+                     size);
+        } else {
+            status = "416 Range Not Satisfiable";
+            snprintf(range, sizeof(range), "Content-Range: bytes */%zu\r\n",
+                     size);
+        }
+    }
+
+    char header[BUFSIZE * 2];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n"
+                       "%s"
+                       "Connection: %s\r\n\r\n",
+                       status, length, range,
+                       cmd->keep_alive ? "keep-alive" : "close");
+    bool sent = conn_append(conn, header, len);
+
+    web_file_t *file = NULL;
+    if (sent && length)
+        file = malloc(sizeof(web_file_t));
+    if (file) {
+        file->fd = fd;
+        file->offset = start;
+        file->remain = length;
+        file->mark = conn->out_len;
+        file->next = NULL;
+        if (conn->files_tail)
+            conn->files_tail->next = file;
+        else
+            conn->files = file;
+        conn->files_tail = file;
+    } else {
+        if (length)
+            sent = false;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    return sent;
+}
+
+static bool serve_metrics(web_conn_t *conn, const web_cmd_t *cmd)
+{
+    metrics.len = 0;
+    for (int i = 0; i < n_metrics_fns; i++)
+        metrics_fns[i]();
+
+    char header[BUFSIZE];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Connection: %s\r\n\r\n",
+                       metrics.len, cmd->keep_alive ? "keep-alive" : "close");
+    return conn_append(conn, header, len) &&
+           conn_append(conn, metrics.data, metrics.len);
+}
+
+/* Answer a request that does not involve the console. The output is
+ * flushed by the caller.
+ */
+static void serve_local(web_cmd_t *cmd)
+{
+    web_conn_t *conn = cmd->conn;
+    if (!conn->close_after) {
+        bool sent = cmd->kind == REQ_FILE ? serve_file(conn, cmd)
+                                          : serve_metrics(conn, cmd);
+        if (!sent || !cmd->keep_alive)
+            conn->close_after = true;
+    }
+    free(cmd);
+}
+
+/* Answer queued requests that do not involve the console. Return true if a
+ * command for the console is waiting at the head of the queue.
+ */
+static bool next_cmd(void)
+{
+    while (cmd_head && cmd_head->kind != REQ_CMD) {
+        web_cmd_t *cmd = pop_cmd();
+        web_conn_t *conn = cmd->conn;
+        conn->pending--;
+        serve_local(cmd);
+        conn_flush(conn);
+    }
+    return cmd_head;
+}
+
+void web_add_metrics(web_metrics_fn fn)
+{
+    if (n_metrics_fns < MAX_METRICS_FN)
+        metrics_fns[n_metrics_fns++] = fn;
+}
+
+void web_metrics_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    buf_vprintf(&metrics, fmt, ap);
+    va_end(ap);
+}
+
+/* Hand the oldest queued command to the console. The response is sent by
+ * web_cmd_done once the command has finished.
+ */
+static int dispatch_cmd(char *buf)
+{
+    web_cmd_t *cmd = pop_cmd();
+    active_cmd = cmd;
+    reply.len = 0;
+    /* Let script output be read like a trace run */
+    if (cmd->batch)
+        buf_printf(&reply, "cmd> %s\n", cmd->line);
+    clock_gettime(CLOCK_MONOTONIC, &active_start);
+
+    strncpy(buf, cmd->line, MAXLINE);
+    return strlen(buf);
+}
+
+void web_vprintf(const char *fmt, va_list ap)
+{
+    /* Nothing to capture, or nobody left to receive it */
+    if (!active_cmd || active_cmd->conn->close_after)
+        return;
+    buf_vprintf(&reply, fmt, ap);
+}
+
+/* Response to a single command sent with GET */
+static bool reply_single(web_conn_t *conn,
+                         const web_cmd_t *cmd,
+                         bool ok,
+                         double ms)
+{
+    char header[BUFSIZE];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Server-Timing: cmd;dur=%.3f\r\n"
+                       "X-Command-Status: %s\r\n"
+                       "Connection: %s\r\n\r\n",
+                       reply.len, ms, ok ? "ok" : "error",
+                       cmd->keep_alive ? "keep-alive" : "close");
+    return conn_append(conn, header, len) &&
+           conn_append(conn, reply.data, reply.len);
+}
+
+/* One chunk of the response to a POST script, ending with a status line */
+static bool reply_chunk(web_conn_t *conn,
+                        const web_cmd_t *cmd,
+                        bool ok,
+                        double ms)
+{
+    char header[BUFSIZE];
+    int len = 0;
+    if (cmd->batch_first)
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Transfer-Encoding: chunked\r\n"
+                       "Connection: %s\r\n\r\n",
+                       cmd->keep_alive ? "keep-alive" : "close");
+
+    buf_printf(&reply, "# %s, %.3f ms\n", ok ? "ok" : "error", ms);
+    len += snprintf(header + len, sizeof(header) - len, "%zx\r\n", reply.len);
+    if (!conn_append(conn, header, len) ||
+        !conn_append(conn, reply.data, reply.len))
+        return false;
+
+    if (cmd->batch_last)
+        return conn_append(conn, "\r\n0\r\n\r\n", 7);
+    return conn_append(conn, "\r\n", 2);
+}
+
+void web_cmd_done(bool ok)
+{
+    web_cmd_t *cmd = active_cmd;
+    if (!cmd)
+        return;
+    active_cmd = NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - active_start.tv_sec) * 1e3 +
+                (now.tv_nsec - active_start.tv_nsec) / 1e6;
+
+    web_conn_t *conn = cmd->conn;
+    conn->pending--;
+    if (!conn->close_after) {
+        bool sent = cmd->batch ? reply_chunk(conn, cmd, ok, ms)
+                               : reply_single(conn, cmd, ok, ms);
+        bool last = !cmd->batch || cmd->batch_last;
+        if (!sent || (last && !cmd->keep_alive))
+            conn->close_after = true;
+    }
+    conn_flush(conn);
+    free(cmd);
+}
+
+int web_eventmux(char *buf)
+{
+    for (;;) {
+        /* Commands already received take precedence over waiting */
+        if (next_cmd())
+            return dispatch_cmd(buf);
+
+        mux_event_t events[MAX_EVENTS];
+        int n = mux_wait(events, MAX_EVENTS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        bool stdin_ready = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].tag == &stdin_tag) {
+                stdin_ready = true;
+            } else if (events[i].tag == &listen_tag) {
+                accept_conns();
+            } else {
+                web_conn_t *conn = events[i].tag;
+                if (events[i].writable && !conn_flush(conn))
+                    continue;
+                if (events[i].readable)
+                    conn_read(conn);
+            }
+        }
+
+        if (next_cmd())
+            return dispatch_cmd(buf);
+        if (stdin_ready)
+            return 0;
+    }
 }
@@ -2,13 +2,26 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
 
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+int web_eventmux(char *buf);
 
-void web_send(int out_fd, char *buffer);
+/* Append output to the response of the command being served, if any */
+void web_vprintf(const char *fmt, va_list ap);
 
-int web_eventmux(char *buf);
+/* Send the response of the command being served, if any */
+void web_cmd_done(bool ok);
+
+/* Function adding lines in Prometheus text format to the /metrics response */
+typedef void (*web_metrics_fn)(void);
+
+/* Register function called whenever /metrics is requested */
+void web_add_metrics(web_metrics_fn fn);
+
+/* Append to the /metrics response being built */
+void web_metrics_printf(const char *fmt, ...);
 
 #endif